@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "ast.h"
+#include "intern.h"
 
 ASTNode *ast_root = NULL;
 
@@ -12,6 +13,7 @@ ASTNode *create_ast_node(NodeType type) {
         exit(1);
     }
     node->node_type = type;
+    node->synthetic = 0;
     node->key = NULL;
     node->string_value = NULL;
     node->children = NULL;
@@ -53,9 +55,9 @@ ASTNode *make_array(ASTNode *elements) {
     return node;
 }
 
-ASTNode *make_pair(char *key, ASTNode *value) {
+ASTNode *make_pair(const char *key, ASTNode *value) {
     ASTNode *node = create_ast_node(PAIR_NODE);
-    node->key = strdup(key);  // Duplicate the key string
+    node->key = intern_key(key);  // Shared with every other pair using the same key
     node->children = value;
     return node;
 }
@@ -80,8 +82,7 @@ void free_ast(ASTNode *node) {
     free_ast(node->children);
     free_ast(node->next);
 
-    // Free any dynamically allocated memory for key or string value
-    if (node->key) free(node->key);
+    // Free any dynamically allocated string value (keys are interned and freed separately)
     if (node->node_type == STRING_NODE && node->string_value) {
         free(node->string_value);  // Free string value if it's a STRING_NODE
     }
@@ -90,6 +91,21 @@ void free_ast(ASTNode *node) {
     free(node);
 }
 
+// Bytes requested from malloc for the nodes and string values of a tree
+// (allocator overhead and interned keys are not included)
+size_t ast_memory_usage(ASTNode *node) {
+    size_t total = 0;
+    while (node) {
+        total += sizeof(ASTNode);
+        if (node->node_type == STRING_NODE && node->string_value) {
+            total += strlen(node->string_value) + 1;
+        }
+        total += ast_memory_usage(node->children);
+        node = node->next;
+    }
+    return total;
+}
+
 void print_ast(ASTNode *node, int indent) {
     if (!node) return;
 
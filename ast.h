@@ -1,6 +1,8 @@
 #ifndef AST_H
 #define AST_H
 
+#include <stddef.h>
+
 typedef enum {
     OBJECT_NODE,
     ARRAY_NODE,
@@ -11,13 +13,17 @@ typedef enum {
     NULL_NODE
 } NodeType;
 
+struct Schema;
+
 typedef struct ASTNode {
     NodeType node_type;
-    char *key;  // For PAIR_NODE
+    int synthetic;    // Set on pairs added during CSV generation (e.g. "seq")
+    const char *key;  // For PAIR_NODE (interned, see intern.h)
     union {
         char *string_value;
         double number_value;
         int boolean_value;
+        struct Schema *schema;  // For OBJECT_NODE: schema cached by the parallel planner
     };
     struct ASTNode *children;  // For OBJECT or ARRAY
     struct ASTNode *next;      // For sibling nodes
@@ -25,9 +31,16 @@ typedef struct ASTNode {
 
 extern ASTNode *ast_root;
 
+// When set, lexical and syntax errors make the parse fail instead of exiting
+// (used by --serve to survive bad documents); whatever was built of the
+// document so far is freed
+extern int parse_errors_recoverable;
+void parse_failed(void);
+
 ASTNode *create_ast_node(NodeType type);
 void free_ast(ASTNode *node);
 void print_ast(ASTNode *node, int indent);
+size_t ast_memory_usage(ASTNode *node);
 
 // JSON constructors
 ASTNode *make_string(char *val);
@@ -36,7 +49,7 @@ ASTNode *make_bool(int val);
 ASTNode *make_null(void);
 ASTNode *make_object(ASTNode *pair_list);
 ASTNode *make_array(ASTNode *elements);
-ASTNode *make_pair(char *key, ASTNode *value);
+ASTNode *make_pair(const char *key, ASTNode *value);
 ASTNode *make_pair_list(ASTNode *pair, ASTNode *pair_list);
 ASTNode *make_array_list(ASTNode *element, ASTNode *element_list);
 
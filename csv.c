@@ -1,16 +1,150 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include "ast.h"
 #include "schema.h"
+#include "csv.h"
+#include "dedup.h"
+#include "pool.h"
+#include "intern.h"
+
+// Table files kept open at once; parts beyond this are closed least recently
+// used first and reopened for appending when they receive another row
+#define MAX_OPEN_FILES 64
+// Rows are formatted into per-shard batches of about this size, which are
+// written out by the shard's writer thread
+#define WRITE_BATCH_BYTES (64 * 1024)
+// Batches a shard may have queued before the formatting thread waits
+#define MAX_QUEUED_BATCHES 8
+
+// The bookkeeping fields are owned by the thread formatting rows; `file`,
+// `started` and the LRU links by the writer of the part's shard
+typedef struct CSVPart {
+    char *filename;
+    int shard;
+    long row_count;
+    long byte_count;
+    int min_id;
+    int max_id;
+    FILE *file;             // NULL while closed to stay within MAX_OPEN_FILES
+    int started;            // Set once the file has been created
+    struct CSVPart *lru_prev;
+    struct CSVPart *lru_next;
+} CSVPart;
 
 typedef struct {
     char *name;
-    FILE *file;
-    int row_count;
+    Schema *schema;     // NULL for scalar array tables
+    CSVPart **parts;    // Every part written so far, in creation order
+    int num_parts;
+    int parts_capacity;
+    int *open_part;     // Per shard: index into parts, or -1
+    int *next_part;     // Per shard: sequence number of the next part
 } CSVTable;
 
+// Consecutive bytes of a batch destined for one part
+typedef struct {
+    CSVPart *part;
+    long end;   // Offset just past the bytes in the batch
+    int close;  // The part has rolled over; close it once written
+} BatchRecord;
+
+typedef struct WriteBatch {
+    FILE *stream;
+    char *data;
+    size_t size;
+    BatchRecord *records;
+    int num_records;
+    int records_capacity;
+    int flush;  // fflush the shard's open files once written
+    struct WriteBatch *next;
+} WriteBatch;
+
+// Writes the parts of one shard. With a single shard batches are written
+// by the calling thread and no writer thread is started.
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t batch_ready;
+    pthread_cond_t batch_done;
+    WriteBatch *head;        // Queued batches, oldest first
+    WriteBatch *tail;
+    int queued;              // Batches queued or being written
+    int stopping;
+    WriteBatch *batch;       // Batch being filled
+
+    CSVPart *lru_head;       // Open parts, most recently used first
+    CSVPart *lru_tail;
+    int open_count;
+} ShardWriter;
+
+static CSVOutputOptions output_options = { 1, SHARD_BY_ID, 0, 0 };
+static CSVTable **tables = NULL;
+static int num_tables = 0;
+static int tables_capacity = 0;
+static ShardWriter *writers = NULL;  // Per shard
+static int writer_threads = 0;       // Set when each shard has its own thread
+static int max_open_per_shard = MAX_OPEN_FILES;
+static CSVPart *current_part = NULL;
+static long current_row_start = 0;
+static long unflushed_bytes = 0;  // Written to table files since the last flush_csv_tables()
+
+// Objects with at least this many rows below them have their children
+// written in parallel when more than one thread is configured
+#define PARALLEL_MIN_ROWS 64
+// Children are grouped into tasks of about this many rows
+#define PARALLEL_TASK_ROWS 256
+// Children with at least this many rows are written by the calling thread,
+// which splits them across the pool in turn
+#define PARALLEL_SPLIT_ROWS 4096
+// Tasks per thread in each round; a round's output is buffered in memory
+// until it is merged, which bounds memory use
+#define PARALLEL_TASKS_PER_THREAD 8
+
+typedef struct {
+    int row_id;
+    int parent_id;
+    long end;  // Offset just past the row in the table's stream
+} TaskRow;
+
+// Rows of one table produced by a task, kept in memory until merged
+typedef struct {
+    const char *name;
+    Schema *schema;
+    FILE *stream;
+    char *data;
+    size_t size;
+    TaskRow *rows;
+    int num_rows;
+    int rows_capacity;
+} TaskTable;
+
+// One child of an object written as a unit: a nested object value (index -1)
+// or one element of an array value
+typedef struct {
+    ASTNode *pair;
+    ASTNode *node;
+    int index;
+} ChildUnit;
+
+typedef struct {
+    ChildUnit first;      // First of the consecutive children the task writes
+    int num_units;
+    int parent_id;
+    int next_id;          // Next id of the block reserved for this task
+    const char *out_dir;
+    TaskTable **tables;   // Allocated one by one: their streams point into them
+    int num_tables;
+    int tables_capacity;
+    TaskTable *current;   // Table of the row being written
+} CSVTask;
+
+static int num_threads = 1;
+static ThreadPool *pool = NULL;
+static __thread CSVTask *current_task = NULL;
+
 void escape_csv_string(FILE *file, const char *str) {
     int needs_quoting = 0;
     const char *p = str;
@@ -60,52 +194,582 @@ void write_csv_header(FILE *file, Schema *schema) {
     fprintf(file, "\n");
 }
 
-void add_seq_to_object(ASTNode *object, int seq) {
-    if (!object || object->node_type != OBJECT_NODE) return;
+void set_csv_output_options(const CSVOutputOptions *options) {
+    output_options = *options;
+    if (output_options.num_shards < 1) output_options.num_shards = 1;
+}
+
+static int output_is_split(void) {
+    return output_options.num_shards > 1 || output_options.roll_rows > 0 || output_options.roll_bytes > 0;
+}
+
+static void *shard_writer_main(void *data);
+
+static void start_shard_writers(void) {
+    int num_shards = output_options.num_shards;
+    writers = calloc(num_shards, sizeof(ShardWriter));
+    if (!writers) {
+        perror("Failed to allocate shard writers");
+        exit(1);
+    }
+    max_open_per_shard = MAX_OPEN_FILES / num_shards;
+    if (max_open_per_shard < 1) max_open_per_shard = 1;
+
+    writer_threads = num_shards > 1;
+    if (!writer_threads) return;
+    for (int i = 0; i < num_shards; i++) {
+        pthread_mutex_init(&writers[i].lock, NULL);
+        pthread_cond_init(&writers[i].batch_ready, NULL);
+        pthread_cond_init(&writers[i].batch_done, NULL);
+        if (pthread_create(&writers[i].thread, NULL, shard_writer_main, &writers[i]) != 0) {
+            perror("Failed to start shard writer");
+            exit(1);
+        }
+    }
+}
+
+// Scalar array tables are named after their key, which becomes part of file
+// names: '/' and control characters are replaced with '_', as is a leading '.'
+// (so neither ".." nor hidden files can be produced), and an empty key is "_"
+static const char *safe_table_name(const char *name, char *buffer, size_t size) {
+    int safe = name[0] != '\0' && name[0] != '.';
+    for (const char *c = name; safe && *c; c++) {
+        if (*c == '/' || (unsigned char)*c < 0x20 || *c == 0x7f) safe = 0;
+    }
+    if (safe) return name;
+
+    size_t len = 0;
+    for (; name[len] && len + 1 < size; len++) {
+        unsigned char c = name[len];
+        buffer[len] = (c == '/' || c < 0x20 || c == 0x7f || (len == 0 && c == '.')) ? '_' : c;
+    }
+    if (len == 0) buffer[len++] = '_';
+    buffer[len] = '\0';
+    return buffer;
+}
+
+static CSVTable *find_or_create_table(const char *name, Schema *schema) {
+    char buffer[256];
+    name = safe_table_name(name, buffer, sizeof(buffer));
+
+    for (int i = 0; i < num_tables; i++) {
+        if (strcmp(tables[i]->name, name) == 0) {
+            return tables[i];
+        }
+    }
+
+    if (num_tables == tables_capacity) {
+        tables_capacity = tables_capacity ? tables_capacity * 2 : 16;
+        tables = realloc(tables, tables_capacity * sizeof(CSVTable *));
+        if (!tables) {
+            perror("Failed to allocate CSV tables");
+            exit(1);
+        }
+    }
+    if (!writers) {
+        start_shard_writers();
+    }
+
+    CSVTable *table = malloc(sizeof(CSVTable));
+    if (!table) {
+        perror("Failed to allocate CSV table");
+        exit(1);
+    }
+    table->name = strdup(name);
+    table->schema = schema;
+    table->parts = NULL;
+    table->num_parts = 0;
+    table->parts_capacity = 0;
+    table->open_part = malloc(output_options.num_shards * sizeof(int));
+    table->next_part = malloc(output_options.num_shards * sizeof(int));
+    if (!table->name || !table->open_part || !table->next_part) {
+        perror("Failed to allocate CSV table");
+        exit(1);
+    }
+    for (int i = 0; i < output_options.num_shards; i++) {
+        table->open_part[i] = -1;
+        table->next_part[i] = 1;
+    }
+    tables[num_tables++] = table;
+    return table;
+}
+
+static void unlink_open_part(ShardWriter *writer, CSVPart *part) {
+    if (part->lru_prev) part->lru_prev->lru_next = part->lru_next;
+    else writer->lru_head = part->lru_next;
+    if (part->lru_next) part->lru_next->lru_prev = part->lru_prev;
+    else writer->lru_tail = part->lru_prev;
+    part->lru_prev = part->lru_next = NULL;
+    writer->open_count--;
+}
+
+static void link_open_part(ShardWriter *writer, CSVPart *part) {
+    part->lru_prev = NULL;
+    part->lru_next = writer->lru_head;
+    if (writer->lru_head) writer->lru_head->lru_prev = part;
+    else writer->lru_tail = part;
+    writer->lru_head = part;
+    writer->open_count++;
+}
+
+static void close_part(ShardWriter *writer, CSVPart *part) {
+    if (part->file) {
+        unlink_open_part(writer, part);
+        fclose(part->file);
+        part->file = NULL;
+    }
+}
+
+// Returns the part's file, creating it on first use or reopening it for
+// appending if it was closed to stay within MAX_OPEN_FILES, and marks it as
+// the most recently used
+static FILE *use_part(ShardWriter *writer, CSVPart *part) {
+    if (part->file) {
+        if (writer->lru_head != part) {
+            unlink_open_part(writer, part);
+            link_open_part(writer, part);
+        }
+        return part->file;
+    }
+
+    while (writer->open_count >= max_open_per_shard) {
+        close_part(writer, writer->lru_tail);
+    }
+    part->file = fopen(part->filename, part->started ? "a" : "w");
+    if (!part->file) {
+        perror(part->started ? "Failed to reopen CSV file" : "Failed to open CSV file");
+        exit(1);
+    }
+    part->started = 1;
+    link_open_part(writer, part);
+    return part->file;
+}
+
+static void write_batch(ShardWriter *writer, WriteBatch *batch) {
+    long start = 0;
+    for (int i = 0; i < batch->num_records; i++) {
+        BatchRecord *record = &batch->records[i];
+        if (record->end > start) {
+            FILE *file = use_part(writer, record->part);
+            if (fwrite(batch->data + start, 1, record->end - start, file) != (size_t)(record->end - start)) {
+                perror("Failed to write CSV file");
+                exit(1);
+            }
+        }
+        if (record->close) {
+            close_part(writer, record->part);
+        }
+        start = record->end;
+    }
+    if (batch->flush) {
+        for (CSVPart *part = writer->lru_head; part; part = part->lru_next) {
+            fflush(part->file);
+        }
+    }
+
+    free(batch->data);
+    free(batch->records);
+    free(batch);
+}
 
-    ASTNode *seq_node = malloc(sizeof(ASTNode));
-    if (!seq_node) return;
-    seq_node->node_type = NUMBER_NODE;
-    seq_node->number_value = seq;
-    seq_node->next = NULL;
+static void *shard_writer_main(void *data) {
+    ShardWriter *writer = data;
 
-    ASTNode *pair_node = malloc(sizeof(ASTNode));
-    if (!pair_node) {
-        free(seq_node);
+    pthread_mutex_lock(&writer->lock);
+    for (;;) {
+        while (!writer->head && !writer->stopping) {
+            pthread_cond_wait(&writer->batch_ready, &writer->lock);
+        }
+        if (!writer->head) break;
+        WriteBatch *batch = writer->head;
+        writer->head = batch->next;
+        if (!writer->head) writer->tail = NULL;
+        pthread_mutex_unlock(&writer->lock);
+
+        write_batch(writer, batch);
+
+        pthread_mutex_lock(&writer->lock);
+        writer->queued--;
+        pthread_cond_signal(&writer->batch_done);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// Returns the batch rows of the shard are currently formatted into
+static WriteBatch *shard_batch(int shard) {
+    ShardWriter *writer = &writers[shard];
+    if (!writer->batch) {
+        WriteBatch *batch = calloc(1, sizeof(WriteBatch));
+        if (!batch) {
+            perror("Failed to allocate write batch");
+            exit(1);
+        }
+        batch->stream = open_memstream(&batch->data, &batch->size);
+        if (!batch->stream) {
+            perror("Failed to open write batch");
+            exit(1);
+        }
+        writer->batch = batch;
+    }
+    return writer->batch;
+}
+
+// Notes that the batch's bytes up to its current end belong to `part`
+static void add_batch_record(WriteBatch *batch, CSVPart *part, int close) {
+    long end = ftell(batch->stream);
+    BatchRecord *last = batch->num_records ? &batch->records[batch->num_records - 1] : NULL;
+    if (last && last->part == part && !last->close) {
+        last->end = end;
+        last->close = close;
         return;
     }
 
-    pair_node->node_type = PAIR_NODE;
-    pair_node->key = strdup("seq");
-    pair_node->children = seq_node;
+    if (batch->num_records == batch->records_capacity) {
+        batch->records_capacity = batch->records_capacity ? batch->records_capacity * 2 : 64;
+        batch->records = realloc(batch->records, batch->records_capacity * sizeof(BatchRecord));
+        if (!batch->records) {
+            perror("Failed to allocate write batch");
+            exit(1);
+        }
+    }
+    batch->records[batch->num_records].part = part;
+    batch->records[batch->num_records].end = end;
+    batch->records[batch->num_records].close = close;
+    batch->num_records++;
+}
+
+// Hands the shard's current batch to its writer, waiting while the writer
+// is MAX_QUEUED_BATCHES behind
+static void submit_batch(int shard) {
+    ShardWriter *writer = &writers[shard];
+    WriteBatch *batch = writer->batch;
+    if (!batch) return;
+    writer->batch = NULL;
+    fclose(batch->stream);
+    batch->stream = NULL;
+
+    if (!writer_threads) {
+        write_batch(writer, batch);
+        return;
+    }
+
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queued >= MAX_QUEUED_BATCHES) {
+        pthread_cond_wait(&writer->batch_done, &writer->lock);
+    }
+    if (writer->tail) writer->tail->next = batch;
+    else writer->head = batch;
+    writer->tail = batch;
+    writer->queued++;
+    pthread_cond_signal(&writer->batch_ready);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+static void wait_for_shard_writer(int shard) {
+    ShardWriter *writer = &writers[shard];
+    if (!writer_threads) return;
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queued > 0) {
+        pthread_cond_wait(&writer->batch_done, &writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+}
+
+// Starts a new part for the given shard, named after the split mode in use:
+// <table>.csv, <table>.shardS.csv, <table>.partP.csv or <table>.shardS.partP.csv
+static CSVPart *open_new_part(CSVTable *table, int shard, const char *out_dir) {
+    if (table->num_parts == table->parts_capacity) {
+        table->parts_capacity = table->parts_capacity ? table->parts_capacity * 2 : 4;
+        table->parts = realloc(table->parts, table->parts_capacity * sizeof(CSVPart *));
+        if (!table->parts) {
+            perror("Failed to allocate CSV parts");
+            exit(1);
+        }
+    }
+
+    char suffix[64] = "";
+    int rolling = output_options.roll_rows > 0 || output_options.roll_bytes > 0;
+    if (output_options.num_shards > 1 && rolling) {
+        snprintf(suffix, sizeof(suffix), ".shard%d.part%d", shard, table->next_part[shard]);
+    } else if (output_options.num_shards > 1) {
+        snprintf(suffix, sizeof(suffix), ".shard%d", shard);
+    } else if (rolling) {
+        snprintf(suffix, sizeof(suffix), ".part%d", table->next_part[shard]);
+    }
+    table->next_part[shard]++;
+
+    char filename[512];
+    snprintf(filename, sizeof(filename), "%s/%s%s.csv", out_dir, table->name, suffix);
+
+    CSVPart *part = calloc(1, sizeof(CSVPart));
+    if (!part) {
+        perror("Failed to allocate CSV part");
+        exit(1);
+    }
+    part->filename = strdup(filename);
+    part->shard = shard;
+
+    // Every part carries its own header so it can be loaded on its own
+    WriteBatch *batch = shard_batch(shard);
+    long start = ftell(batch->stream);
+    if (table->schema) {
+        write_csv_header(batch->stream, table->schema);
+    } else {
+        fprintf(batch->stream, "parent_id,index,value\n");
+    }
+    add_batch_record(batch, part, 0);
+    part->byte_count = ftell(batch->stream) - start;
+    unflushed_bytes += part->byte_count;
+
+    table->parts[table->num_parts] = part;
+    table->open_part[shard] = table->num_parts++;
+    return part;
+}
+
+// Returns the stream the next row of the table should be formatted into,
+// rolling over to a new part when the current one has reached its row or
+// byte limit. Scalar array tables pass their parent id as row_id.
+static FILE *begin_task_row(CSVTask *task, const char *name, Schema *schema, int row_id, int parent_id);
+
+static FILE *begin_table_row(const char *name, Schema *schema, int row_id, int parent_id, const char *out_dir) {
+    if (current_task) {
+        return begin_task_row(current_task, name, schema, row_id, parent_id);
+    }
+
+    CSVTable *table = find_or_create_table(name, schema);
+
+    int shard = 0;
+    if (output_options.num_shards > 1) {
+        int key = (output_options.shard_key == SHARD_BY_PARENT && parent_id > 0) ? parent_id : row_id;
+        shard = (int)(((unsigned int)key * 2654435761u) % (unsigned int)output_options.num_shards);
+    }
+
+    CSVPart *part = NULL;
+    if (table->open_part[shard] >= 0) {
+        part = table->parts[table->open_part[shard]];
+        if ((output_options.roll_rows > 0 && part->row_count >= output_options.roll_rows) ||
+            (output_options.roll_bytes > 0 && part->byte_count >= output_options.roll_bytes)) {
+            add_batch_record(shard_batch(shard), part, 1);
+            part = NULL;
+        }
+    }
+    if (!part) {
+        part = open_new_part(table, shard, out_dir);
+    }
+
+    if (part->row_count == 0 || row_id < part->min_id) part->min_id = row_id;
+    if (part->row_count == 0 || row_id > part->max_id) part->max_id = row_id;
+    part->row_count++;
+
+    WriteBatch *batch = shard_batch(shard);
+    current_part = part;
+    current_row_start = ftell(batch->stream);
+    return batch->stream;
+}
+
+static void end_table_row(void) {
+    if (current_task) {
+        TaskTable *table = current_task->current;
+        table->rows[table->num_rows - 1].end = ftell(table->stream);
+        return;
+    }
+    if (current_part) {
+        WriteBatch *batch = writers[current_part->shard].batch;
+        add_batch_record(batch, current_part, 0);
+        long length = batch->records[batch->num_records - 1].end - current_row_start;
+        current_part->byte_count += length;
+        unflushed_bytes += length;
+        if (ftell(batch->stream) >= WRITE_BATCH_BYTES) {
+            submit_batch(current_part->shard);
+        }
+        current_part = NULL;
+    }
+}
+
+// Writes <table>.index.csv listing every part with its id range and row count.
+// Scalar array tables have no id column; their range is over parent ids.
+static void write_table_index(CSVTable *table, const char *out_dir) {
+    char filename[512];
+    snprintf(filename, sizeof(filename), "%s/%s.index.csv", out_dir, table->name);
+
+    FILE *file = fopen(filename, "w");
+    if (!file) {
+        perror("Failed to open CSV index file");
+        exit(1);
+    }
+
+    if (table->schema) {
+        fprintf(file, "part,shard,rows,bytes,min_id,max_id\n");
+    } else {
+        fprintf(file, "part,shard,rows,bytes,min_parent_id,max_parent_id\n");
+    }
+    for (int i = 0; i < table->num_parts; i++) {
+        CSVPart *part = table->parts[i];
+        const char *base = strrchr(part->filename, '/');
+        escape_csv_string(file, base ? base + 1 : part->filename);
+        fprintf(file, ",%d,%ld,%ld,%d,%d\n", part->shard, part->row_count,
+                part->byte_count, part->min_id, part->max_id);
+    }
+    fclose(file);
+}
+
+// Writes out every pending batch and flushes the open table files, waiting
+// for the shard writers to finish
+void flush_csv_tables(void) {
+    if (writers) {
+        for (int i = 0; i < output_options.num_shards; i++) {
+            shard_batch(i)->flush = 1;
+            submit_batch(i);
+        }
+        for (int i = 0; i < output_options.num_shards; i++) {
+            wait_for_shard_writer(i);
+        }
+    }
+    unflushed_bytes = 0;
+}
+
+long csv_unflushed_bytes(void) {
+    return unflushed_bytes;
+}
+
+void close_csv_tables(const char *out_dir) {
+    if (writers) {
+        for (int i = 0; i < output_options.num_shards; i++) {
+            ShardWriter *writer = &writers[i];
+            submit_batch(i);
+            if (writer_threads) {
+                pthread_mutex_lock(&writer->lock);
+                writer->stopping = 1;
+                pthread_cond_signal(&writer->batch_ready);
+                pthread_mutex_unlock(&writer->lock);
+                pthread_join(writer->thread, NULL);
+                pthread_mutex_destroy(&writer->lock);
+                pthread_cond_destroy(&writer->batch_ready);
+                pthread_cond_destroy(&writer->batch_done);
+            }
+            while (writer->lru_head) {
+                close_part(writer, writer->lru_head);
+            }
+        }
+    }
+
+    for (int i = 0; i < num_tables; i++) {
+        CSVTable *table = tables[i];
+        if (output_is_split()) {
+            write_table_index(table, out_dir);
+        }
+        for (int j = 0; j < table->num_parts; j++) {
+            free(table->parts[j]->filename);
+            free(table->parts[j]);
+        }
+        free(table->parts);
+        free(table->open_part);
+        free(table->next_part);
+        free(table->name);
+        free(table);
+    }
+    free(tables);
+    tables = NULL;
+    num_tables = 0;
+    tables_capacity = 0;
+    free(writers);
+    writers = NULL;
+    writer_threads = 0;
+    unflushed_bytes = 0;
+}
+
+void add_seq_to_object(ASTNode *object, int seq) {
+    if (!object || object->node_type != OBJECT_NODE) return;
+    // Already added when the document's schemas were registered
+    if (object->children && object->children->synthetic) return;
+
+    ASTNode *pair_node = make_pair("seq", make_number(seq));
+    pair_node->synthetic = 1;
     pair_node->next = object->children;
 
     object->children = pair_node;
 }
 
-int write_object_to_csv(ASTNode *object, Schema *schema, int parent_id, const char *out_dir) {
-    static int next_id = 1;
-    if (!object || !schema) return -1;
+static int next_id = 1;
 
-    int current_id = next_id++;
+// Inside a parallel task, ids come from the block reserved for the task
+static int allocate_row_id(void) {
+    if (current_task) return current_task->next_id++;
+    return next_id++;
+}
 
-    char filename[256];
-    snprintf(filename, sizeof(filename), "%s/%s.csv", out_dir, schema->name);
+static Schema *schema_of(ASTNode *object) {
+    if (object->schema) return object->schema;
+    return get_schema_for_object(object);
+}
 
-    FILE *file = fopen(filename, "a");
-    if (!file) {
-        file = fopen(filename, "w");
-        if (!file) {
-            perror("Failed to open CSV file");
-            exit(1);
+static void write_children_in_parallel(ASTNode *object, int parent_id, const char *out_dir);
+static int count_rows(ASTNode *object, int limit);
+
+typedef struct {
+    ASTNode *pair;
+    int id;
+    int is_new;  // The subtree has not been written yet and must be emitted
+} NestedRef;
+
+// In dedup mode, resolves the row id of every nested object value before the
+// row is written so the parent row can reference it. Identical subtrees seen
+// before reuse their id; new ones get a fresh id and are recorded.
+static int resolve_nested_refs(ASTNode *object, NestedRef *refs) {
+    int num_refs = 0;
+    for (ASTNode *pair = object->children; pair && num_refs < MAX_COLUMNS; pair = pair->next) {
+        if (pair->node_type != PAIR_NODE || !pair->children || pair->children->node_type != OBJECT_NODE) {
+            continue;
+        }
+        NestedRef *ref = &refs[num_refs++];
+        ref->pair = pair;
+        ref->id = dedup_lookup(pair->children);
+        ref->is_new = ref->id == 0;
+        if (ref->is_new) {
+            ref->id = allocate_row_id();
+            dedup_insert(ref->id);
         }
-        write_csv_header(file, schema);
     }
+    return num_refs;
+}
+
+static NestedRef *find_nested_ref(NestedRef *refs, int num_refs, ASTNode *pair) {
+    for (int i = 0; i < num_refs; i++) {
+        if (refs[i].pair == pair) return &refs[i];
+    }
+    return NULL;
+}
+
+static int write_object_with_id(ASTNode *object, Schema *schema, int current_id, int parent_id, const char *out_dir);
+
+static void write_array_element(ASTNode *element, ASTNode *pair, int index, int parent_id, const char *out_dir) {
+    if (element->node_type == OBJECT_NODE) {
+        Schema *nested_schema = schema_of(element);
+        if (nested_schema) {
+            write_object_to_csv(element, nested_schema, parent_id, out_dir);
+        }
+    }
+    else if (element->node_type == STRING_NODE) {
+        FILE *array_file = begin_table_row(pair->key, NULL, parent_id, parent_id, out_dir);
+
+        fprintf(array_file, "%d,%d,", parent_id, index);
+        escape_csv_string(array_file, element->string_value);
+        fprintf(array_file, "\n");
+        end_table_row();
+    }
+}
+
+static int write_object_with_id(ASTNode *object, Schema *schema, int current_id, int parent_id, const char *out_dir) {
+    NestedRef refs[MAX_COLUMNS];
+    int num_refs = dedup_enabled() ? resolve_nested_refs(object, refs) : 0;
+
+    FILE *file = begin_table_row(schema->name, schema, current_id, parent_id, out_dir);
 
     fprintf(file, "%d", current_id);
 
     for (int i = 0; i < schema->num_columns; i++) {
-        ASTNode *pair = find_pair_in_object(object, schema->columns[i]);
+        ASTNode *pair = find_pair_by_interned_key(object, schema->columns[i]);
         fprintf(file, ",");
 
         if (pair && pair->children) {
@@ -121,6 +785,12 @@ int write_object_to_csv(ASTNode *object, Schema *schema, int parent_id, const ch
                     break;
                 case NULL_NODE:
                     break;
+                case OBJECT_NODE: {
+                    // Only set in dedup mode: reference the (possibly shared) row
+                    NestedRef *ref = find_nested_ref(refs, num_refs, pair);
+                    if (ref) fprintf(file, "%d", ref->id);
+                    break;
+                }
                 default:
                     break;
             }
@@ -132,7 +802,13 @@ int write_object_to_csv(ASTNode *object, Schema *schema, int parent_id, const ch
     }
 
     fprintf(file, "\n");
-    fclose(file);
+    end_table_row();
+
+    if (num_threads > 1 && !current_task && !dedup_enabled() &&
+        count_rows(object, PARALLEL_MIN_ROWS) >= PARALLEL_MIN_ROWS) {
+        write_children_in_parallel(object, current_id, out_dir);
+        return current_id;
+    }
 
     ASTNode *pair = object->children;
     while (pair) {
@@ -140,9 +816,12 @@ int write_object_to_csv(ASTNode *object, Schema *schema, int parent_id, const ch
             ASTNode *child = pair->children;
 
             if (child->node_type == OBJECT_NODE) {
-                Schema *nested_schema = get_schema_for_object(child);
-                if (nested_schema) {
+                NestedRef *ref = find_nested_ref(refs, num_refs, pair);
+                Schema *nested_schema = schema_of(child);
+                if (nested_schema && !ref) {
                     write_object_to_csv(child, nested_schema, current_id, out_dir);
+                } else if (nested_schema && ref->is_new) {
+                    write_object_with_id(child, nested_schema, ref->id, current_id, out_dir);
                 }
             }
             else if (child->node_type == ARRAY_NODE) {
@@ -152,32 +831,11 @@ int write_object_to_csv(ASTNode *object, Schema *schema, int parent_id, const ch
                 while (element) {
                     ASTNode *next_element = element->next;
 
-                    if (element->node_type == OBJECT_NODE) {
+                    // Parallel tasks run on elements already given their seq
+                    if (element->node_type == OBJECT_NODE && !current_task) {
                         add_seq_to_object(element, index);
-                        Schema *nested_schema = get_schema_for_object(element);
-                        if (nested_schema) {
-                            write_object_to_csv(element, nested_schema, current_id, out_dir);
-                        }
-                    }
-                    else if (element->node_type == STRING_NODE) {
-                        char array_filename[256];
-                        snprintf(array_filename, sizeof(array_filename), "%s/%s.csv", out_dir, pair->key);
-
-                        FILE *array_file = fopen(array_filename, "a");
-                        if (!array_file) {
-                            array_file = fopen(array_filename, "w");
-                            if (!array_file) {
-                                perror("Failed to open CSV file for scalar array");
-                                exit(1);
-                            }
-                            fprintf(array_file, "parent_id,index,value\n");
-                        }
-
-                        fprintf(array_file, "%d,%d,", current_id, index);
-                        escape_csv_string(array_file, element->string_value);
-                        fprintf(array_file, "\n");
-                        fclose(array_file);
                     }
+                    write_array_element(element, pair, index, current_id, out_dir);
 
                     element = next_element;
                     index++;
@@ -191,10 +849,392 @@ int write_object_to_csv(ASTNode *object, Schema *schema, int parent_id, const ch
     return current_id;
 }
 
-void generate_csv(ASTNode *root, const char *out_dir) {
+int write_object_to_csv(ASTNode *object, Schema *schema, int parent_id, const char *out_dir) {
+    if (!object || !schema) return -1;
+    return write_object_with_id(object, schema, allocate_row_id(), parent_id, out_dir);
+}
+
+static FILE *begin_task_row(CSVTask *task, const char *name, Schema *schema, int row_id, int parent_id) {
+    TaskTable *table = NULL;
+    for (int i = 0; i < task->num_tables; i++) {
+        if (task->tables[i]->name == name || strcmp(task->tables[i]->name, name) == 0) {
+            table = task->tables[i];
+            break;
+        }
+    }
+
+    if (!table) {
+        if (task->num_tables == task->tables_capacity) {
+            int capacity = task->tables_capacity ? task->tables_capacity * 2 : 16;
+            task->tables = realloc(task->tables, capacity * sizeof(TaskTable *));
+            if (!task->tables) {
+                perror("Failed to allocate task tables");
+                exit(1);
+            }
+            for (int i = task->tables_capacity; i < capacity; i++) {
+                task->tables[i] = malloc(sizeof(TaskTable));
+                if (!task->tables[i]) {
+                    perror("Failed to allocate task tables");
+                    exit(1);
+                }
+            }
+            task->tables_capacity = capacity;
+        }
+        table = task->tables[task->num_tables++];
+        table->name = name;
+        table->schema = schema;
+        table->stream = open_memstream(&table->data, &table->size);
+        table->rows = NULL;
+        table->num_rows = 0;
+        table->rows_capacity = 0;
+        if (!table->stream) {
+            perror("Failed to open task buffer");
+            exit(1);
+        }
+    }
+
+    if (table->num_rows == table->rows_capacity) {
+        table->rows_capacity = table->rows_capacity ? table->rows_capacity * 2 : 64;
+        table->rows = realloc(table->rows, table->rows_capacity * sizeof(TaskRow));
+        if (!table->rows) {
+            perror("Failed to allocate task rows");
+            exit(1);
+        }
+    }
+    table->rows[table->num_rows].row_id = row_id;
+    table->rows[table->num_rows].parent_id = parent_id;
+    table->num_rows++;
+
+    task->current = table;
+    return table->stream;
+}
+
+// Points `unit` at the first child held by `pair` or a later pair. Returns 0
+// if there is none.
+static int seek_child_unit(ChildUnit *unit, ASTNode *pair) {
+    for (; pair; pair = pair->next) {
+        if (pair->node_type != PAIR_NODE || !pair->children) continue;
+        ASTNode *child = pair->children;
+        if (child->node_type == OBJECT_NODE) {
+            unit->pair = pair;
+            unit->node = child;
+            unit->index = -1;
+            return 1;
+        }
+        if (child->node_type == ARRAY_NODE && child->children) {
+            unit->pair = pair;
+            unit->node = child->children;
+            unit->index = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int next_child_unit(ChildUnit *unit) {
+    if (unit->index >= 0 && unit->node->next) {
+        unit->node = unit->node->next;
+        unit->index++;
+        return 1;
+    }
+    return seek_child_unit(unit, unit->pair->next);
+}
+
+// Counts the rows written below `object`, stopping once `limit` is reached
+static int count_rows(ASTNode *object, int limit) {
+    int rows = 0;
+    ChildUnit unit;
+    for (int more = seek_child_unit(&unit, object->children); more && rows < limit; more = next_child_unit(&unit)) {
+        rows++;
+        if (unit.node->node_type == OBJECT_NODE) rows += count_rows(unit.node, limit - rows);
+    }
+    return rows;
+}
+
+// Writes one child the way the serial loop in write_object_with_id() does
+static void write_child_unit(ChildUnit *unit, int parent_id, const char *out_dir) {
+    if (unit->index < 0) {
+        Schema *nested_schema = schema_of(unit->node);
+        if (nested_schema) {
+            write_object_to_csv(unit->node, nested_schema, parent_id, out_dir);
+        }
+    } else {
+        write_array_element(unit->node, unit->pair, unit->index, parent_id, out_dir);
+    }
+}
+
+static void run_csv_task(void *arg, int task_index) {
+    CSVTask *task = &((CSVTask *)arg)[task_index];
+
+    current_task = task;
+    ChildUnit unit = task->first;
+    for (int i = 0; i < task->num_units; i++) {
+        write_child_unit(&unit, task->parent_id, task->out_dir);
+        next_child_unit(&unit);
+    }
+    current_task = NULL;
+}
+
+// Appends a task's buffered rows to the table writers, row by row, so that
+// sharding and rolling see exactly the rows a serial run would have written
+static void merge_task(CSVTask *task, const char *out_dir) {
+    for (int i = 0; i < task->num_tables; i++) {
+        TaskTable *table = task->tables[i];
+        fclose(table->stream);
+
+        long start = 0;
+        for (int j = 0; j < table->num_rows; j++) {
+            TaskRow *row = &table->rows[j];
+            FILE *file = begin_table_row(table->name, table->schema, row->row_id, row->parent_id, out_dir);
+            fwrite(table->data + start, 1, row->end - start, file);
+            end_table_row();
+            start = row->end;
+        }
+
+        free(table->data);
+        free(table->rows);
+    }
+    task->num_tables = 0;
+}
+
+// Registers the schemas of every object below `object` in the same order the
+// serial writer would, so table names do not depend on thread timing, caches
+// them on the nodes and returns the number of row ids the subtree will use,
+// or -1 if the schema registry is full.
+static int plan_subtree(ASTNode *object) {
+    int ids = 1;
+
+    for (ASTNode *pair = object->children; pair; pair = pair->next) {
+        if (pair->node_type != PAIR_NODE || !pair->children) continue;
+        ASTNode *child = pair->children;
+
+        if (child->node_type == OBJECT_NODE) {
+            child->schema = schema_of(child);
+            int child_ids = child->schema ? plan_subtree(child) : -1;
+            if (child_ids < 0) return -1;
+            ids += child_ids;
+        }
+        else if (child->node_type == ARRAY_NODE) {
+            int index = 0;
+            for (ASTNode *element = child->children; element; element = element->next, index++) {
+                if (element->node_type != OBJECT_NODE) continue;
+                add_seq_to_object(element, index);
+                element->schema = schema_of(element);
+                int element_ids = element->schema ? plan_subtree(element) : -1;
+                if (element_ids < 0) return -1;
+                ids += element_ids;
+            }
+        }
+    }
+
+    return ids;
+}
+
+// Writes the children of a large object (nested object values and array
+// elements, in order) in rounds. Each round consecutive children are planned
+// serially (schemas and id blocks) and grouped into tasks, formatted
+// concurrently into per-task buffers, then merged in order, so the output is
+// identical to a serial run. A child with PARALLEL_SPLIT_ROWS rows or more
+// ends the round and is written by this thread, which splits its own
+// children the same way, so large sibling subtrees are parallelised too.
+static void write_children_in_parallel(ASTNode *object, int parent_id, const char *out_dir) {
+    int max_tasks = num_threads * PARALLEL_TASKS_PER_THREAD;
+    CSVTask *tasks = calloc(max_tasks, sizeof(CSVTask));
+    if (!tasks) {
+        perror("Failed to allocate parallel tasks");
+        exit(1);
+    }
+
+    ChildUnit unit;
+    int more = seek_child_unit(&unit, object->children);
+    while (more) {
+        int num_tasks = 0;
+        int task_rows = 0;
+        int split = 0;
+        while (more) {
+            if (num_tasks == max_tasks && task_rows >= PARALLEL_TASK_ROWS) break;
+            if (unit.index >= 0 && unit.node->node_type == OBJECT_NODE) {
+                add_seq_to_object(unit.node, unit.index);
+            }
+            int rows = 1;
+            if (unit.node->node_type == OBJECT_NODE) {
+                rows += count_rows(unit.node, PARALLEL_SPLIT_ROWS);
+            }
+            if (rows >= PARALLEL_SPLIT_ROWS) {
+                split = 1;
+                break;
+            }
+
+            if (num_tasks == 0 || task_rows >= PARALLEL_TASK_ROWS) {
+                CSVTask *task = &tasks[num_tasks++];
+                task->first = unit;
+                task->num_units = 0;
+                task->parent_id = parent_id;
+                task->next_id = next_id;
+                task->out_dir = out_dir;
+                task->num_tables = 0;
+                task_rows = 0;
+            }
+
+            if (unit.node->node_type == OBJECT_NODE) {
+                // Registered by generate_csv(), so planning cannot fail here
+                unit.node->schema = schema_of(unit.node);
+                next_id += plan_subtree(unit.node);
+            }
+            tasks[num_tasks - 1].num_units++;
+            task_rows += rows;
+            more = next_child_unit(&unit);
+        }
+
+        if (num_tasks > 0) {
+            pool_run(pool, num_tasks, run_csv_task, tasks);
+            for (int i = 0; i < num_tasks; i++) {
+                merge_task(&tasks[i], out_dir);
+            }
+        }
+
+        if (split) {
+            write_child_unit(&unit, parent_id, out_dir);
+            more = next_child_unit(&unit);
+        }
+    }
+
+    for (int i = 0; i < max_tasks; i++) {
+        for (int j = 0; j < tasks[i].tables_capacity; j++) {
+            free(tasks[i].tables[j]);
+        }
+        free(tasks[i].tables);
+    }
+    free(tasks);
+}
+
+void set_csv_threads(int threads) {
+    if (pool) {
+        pool_destroy(pool);
+        pool = NULL;
+    }
+    num_threads = threads > 1 ? threads : 1;
+    if (num_threads > 1) {
+        pool = pool_create(num_threads);
+    }
+}
+
+// Returns the index of the value stored under `key` in a tape object, or 0
+// (never a valid value index) if the key is missing
+static unsigned int find_tape_value(const Tape *tape, unsigned int object, const char *key) {
+    const TapeEntry *entries = tape->entries;
+    for (unsigned int pair = object + 1; pair < entries[object].next; pair = entries[pair].next) {
+        if (entries[pair].key == key) return pair + 1;
+    }
+    return 0;
+}
+
+// Tape counterpart of write_object_with_id(). Array elements pass their index
+// as `seq`, which stands in for the "seq" pair the AST path inserts; other
+// objects pass -1.
+// Tape counterpart of plan_subtree(), without the id count: registers the
+// schema of every object below `object` in the order write_tape_object()
+// looks them up. Returns -1 if the schema registry is full.
+static int plan_tape_object(const Tape *tape, unsigned int object) {
+    const TapeEntry *entries = tape->entries;
+    for (unsigned int pair = object + 1; pair < entries[object].next; pair = entries[pair].next) {
+        unsigned int child = pair + 1;
+
+        if (entries[child].type == OBJECT_NODE) {
+            if (!get_schema_for_tape_object(tape, child, 0) || plan_tape_object(tape, child) < 0) return -1;
+        }
+        else if (entries[child].type == ARRAY_NODE) {
+            for (unsigned int element = child + 1; element < entries[child].next; element = entries[element].next) {
+                if (entries[element].type != OBJECT_NODE) continue;
+                if (!get_schema_for_tape_object(tape, element, 1) || plan_tape_object(tape, element) < 0) return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int write_tape_object(const Tape *tape, unsigned int object, Schema *schema, int seq, int parent_id, const char *out_dir) {
+    static const char *seq_key = NULL;
+    if (!seq_key) seq_key = intern_key("seq");
+
+    const TapeEntry *entries = tape->entries;
+    int current_id = allocate_row_id();
+
+    FILE *file = begin_table_row(schema->name, schema, current_id, parent_id, out_dir);
+
+    fprintf(file, "%d", current_id);
+
+    for (int i = 0; i < schema->num_columns; i++) {
+        fprintf(file, ",");
+
+        if (seq >= 0 && schema->columns[i] == seq_key) {
+            fprintf(file, "%g", (double)seq);
+            continue;
+        }
+
+        unsigned int value = find_tape_value(tape, object, schema->columns[i]);
+        if (!value) continue;
+
+        switch (entries[value].type) {
+            case STRING_NODE:
+                escape_csv_string(file, tape_string(tape, value));
+                break;
+            case NUMBER_NODE:
+                fprintf(file, "%g", entries[value].number_value);
+                break;
+            case BOOLEAN_NODE:
+                fprintf(file, "%s", entries[value].boolean_value ? "true" : "false");
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (schema->parent_id_column && parent_id > 0) {
+        fprintf(file, ",%d", parent_id);
+    }
+
+    fprintf(file, "\n");
+    end_table_row();
+
+    for (unsigned int pair = object + 1; pair < entries[object].next; pair = entries[pair].next) {
+        unsigned int child = pair + 1;
+
+        if (entries[child].type == OBJECT_NODE) {
+            Schema *nested_schema = get_schema_for_tape_object(tape, child, 0);
+            if (nested_schema) {
+                write_tape_object(tape, child, nested_schema, -1, current_id, out_dir);
+            }
+        }
+        else if (entries[child].type == ARRAY_NODE) {
+            int index = 0;
+            for (unsigned int element = child + 1; element < entries[child].next; element = entries[element].next) {
+                if (entries[element].type == OBJECT_NODE) {
+                    Schema *nested_schema = get_schema_for_tape_object(tape, element, 1);
+                    if (nested_schema) {
+                        write_tape_object(tape, element, nested_schema, index, current_id, out_dir);
+                    }
+                }
+                else if (entries[element].type == STRING_NODE) {
+                    FILE *array_file = begin_table_row(entries[pair].key, NULL, current_id, current_id, out_dir);
+
+                    fprintf(array_file, "%d,%d,", current_id, index);
+                    escape_csv_string(array_file, tape_string(tape, element));
+                    fprintf(array_file, "\n");
+                    end_table_row();
+                }
+                index++;
+            }
+        }
+    }
+
+    return current_id;
+}
+
+int generate_csv(ASTNode *root, const char *out_dir) {
     if (!root || root->node_type != OBJECT_NODE) {
         fprintf(stderr, "Invalid root node.\n");
-        return;
+        return -1;
     }
 
     struct stat st = {0};
@@ -202,18 +1242,35 @@ void generate_csv(ASTNode *root, const char *out_dir) {
         mkdir(out_dir, 0755);
     }
 
+    // Every schema is registered before the first row is written, so a
+    // document that does not fit in the registry leaves the tables untouched
     Schema *schema = get_schema_for_object(root);
-    if (!schema) {
-        fprintf(stderr, "Schema not found for root object.\n");
-        return;
+    if (!schema || plan_subtree(root) < 0) {
+        fprintf(stderr, "Document rejected: too many distinct object shapes.\n");
+        return -1;
     }
 
     write_object_to_csv(root, schema, 0, out_dir);
+    return 0;
 }
-void free_csv_table(CSVTable *table) {
-    if (table) {
-        if (table->file) fclose(table->file);
-        free(table->name);
-        free(table);
+
+int generate_csv_from_tape(const Tape *tape, const char *out_dir) {
+    if (!tape || tape->num_entries == 0 || tape->entries[0].type != OBJECT_NODE) {
+        fprintf(stderr, "Invalid root node.\n");
+        return -1;
+    }
+
+    struct stat st = {0};
+    if (stat(out_dir, &st) == -1) {
+        mkdir(out_dir, 0755);
     }
+
+    Schema *schema = get_schema_for_tape_object(tape, 0, 0);
+    if (!schema || plan_tape_object(tape, 0) < 0) {
+        fprintf(stderr, "Document rejected: too many distinct object shapes.\n");
+        return -1;
+    }
+
+    write_tape_object(tape, 0, schema, -1, 0, out_dir);
+    return 0;
 }
@@ -1,9 +1,26 @@
 #ifndef CSV_H
 #define CSV_H
 
+#include <stdio.h>
 #include "ast.h"
 #include "schema.h"
 
+typedef enum {
+    SHARD_BY_ID,
+    SHARD_BY_PARENT
+} ShardKey;
+
+/**
+ * Controls how each table is split across output files.
+ * With the defaults every table goes into a single <table>.csv.
+ */
+typedef struct {
+    int num_shards;      // Number of files each table is hashed into (1 = no sharding)
+    ShardKey shard_key;  // Hash on the row id or on the parent id
+    long roll_rows;      // Start a new part after this many rows (0 = no limit)
+    long roll_bytes;     // Start a new part after this many bytes (0 = no limit)
+} CSVOutputOptions;
+
 /**
  * Escapes special characters in a string to make it CSV-safe.
  * This includes wrapping the string in quotes if it contains commas, newlines, or quotes.
@@ -32,15 +49,67 @@ void write_csv_header(FILE *file, Schema *schema);
  * @param schema The schema for the object.
  * @param parent_id The ID of the parent object (used for child tables).
  * @param out_dir The directory where the CSV files will be saved.
+ * @return The ID assigned to the object's row, or -1 on invalid input.
  */
-void write_object_to_csv(ASTNode *object, Schema *schema, int parent_id, const char *out_dir);
+int write_object_to_csv(ASTNode *object, Schema *schema, int parent_id, const char *out_dir);
 
 /**
  * Generates CSV files for the given ASTNode (root), writing the data into the specified output directory.
  * 
  * @param root The root ASTNode of the object to be serialized into CSV files.
  * @param out_dir The directory where the CSV files will be saved.
+ * @return 0 on success, -1 if the root is not an object or the document's
+ *         object shapes do not fit in the schema registry; no rows are
+ *         written in that case.
+ */
+int generate_csv(ASTNode *root, const char *out_dir);
+
+/**
+ * Generates CSV files from a document parsed into a tape. Produces the same
+ * tables, ids and rows as generate_csv() does for the equivalent AST.
+ *
+ * @param tape The parsed document; its root (entry 0) must be an object.
+ * @param out_dir The directory where the CSV files will be saved.
+ * @return 0 on success, -1 as for generate_csv().
+ */
+int generate_csv_from_tape(const Tape *tape, const char *out_dir);
+
+/**
+ * Sets the sharding and rolling options used for all tables.
+ * Must be called before any rows are written.
+ *
+ * @param options The output options to apply.
+ */
+void set_csv_output_options(const CSVOutputOptions *options);
+
+/**
+ * Sets the number of threads used to write large subtrees. With more than one
+ * thread, the children of any object with at least 64 rows below it are
+ * split across a thread pool, and children with at least 4096 rows are split
+ * the same way recursively; the output is identical to a single-threaded run.
+ * Ignored in dedup mode.
+ *
+ * @param threads Number of threads (1 disables parallel writing).
+ */
+void set_csv_threads(int threads);
+
+/**
+ * Flushes every open table file without closing it.
+ */
+void flush_csv_tables(void);
+
+/**
+ * Returns the number of bytes written to table files since the last flush.
+ */
+long csv_unflushed_bytes(void);
+
+/**
+ * Flushes and closes every open table file. When sharding or rolling is enabled,
+ * also writes a <table>.index.csv per table listing its parts with their row
+ * counts and id ranges.
+ *
+ * @param out_dir The directory where the CSV files were saved.
  */
-void generate_csv(ASTNode *root, const char *out_dir);
+void close_csv_tables(const char *out_dir);
 
 #endif // CSV_H
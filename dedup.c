@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dedup.h"
+#include "intern.h"
+
+#define BUCKET_WAYS 4
+
+// Marks the end of an object's or array's children in an encoding
+#define END_OF_CHILDREN 0xFF
+
+typedef struct {
+    unsigned long hash;
+    unsigned char *encoding;  // NULL if the slot is empty
+    size_t size;
+    int id;
+} DedupEntry;
+
+static DedupEntry *entries = NULL;
+static unsigned char *bucket_victim = NULL;  // Next way to evict in each bucket
+static unsigned long num_buckets = 0;
+static long stored_bytes = 0;
+
+// Encoding of the subtree passed to the last dedup_lookup()
+static unsigned char *scratch = NULL;
+static size_t scratch_size = 0;
+static size_t scratch_capacity = 0;
+static unsigned long scratch_hash = 0;
+
+void dedup_init(int capacity) {
+    dedup_free();
+    if (capacity <= 0) return;
+
+    unsigned long slots = BUCKET_WAYS;
+    while (slots < (unsigned long)capacity) slots *= 2;
+    num_buckets = slots / BUCKET_WAYS;
+
+    entries = calloc(slots, sizeof(DedupEntry));
+    bucket_victim = calloc(num_buckets, 1);
+    if (!entries || !bucket_victim) {
+        perror("Failed to allocate dedup index");
+        exit(1);
+    }
+}
+
+int dedup_enabled(void) {
+    return entries != NULL;
+}
+
+static void append(const void *data, size_t size) {
+    if (scratch_size + size > scratch_capacity) {
+        while (scratch_size + size > scratch_capacity) {
+            scratch_capacity = scratch_capacity ? scratch_capacity * 2 : 256;
+        }
+        scratch = realloc(scratch, scratch_capacity);
+        if (!scratch) {
+            perror("Failed to allocate dedup buffer");
+            exit(1);
+        }
+    }
+    memcpy(scratch + scratch_size, data, size);
+    scratch_size += size;
+}
+
+// Appends a self-delimiting encoding of the subtree: a type byte followed by
+// the value; keys are stored by interned id, which is stable for the run
+static void encode_subtree(ASTNode *node) {
+    unsigned char type = (unsigned char)node->node_type;
+    append(&type, 1);
+
+    switch (node->node_type) {
+        case OBJECT_NODE:
+        case ARRAY_NODE: {
+            for (ASTNode *child = node->children; child; child = child->next) {
+                if (child->synthetic) continue;
+                encode_subtree(child);
+            }
+            unsigned char end = END_OF_CHILDREN;
+            append(&end, 1);
+            break;
+        }
+        case PAIR_NODE: {
+            int key = interned_key_id(node->key);
+            append(&key, sizeof(key));
+            if (node->children) {
+                encode_subtree(node->children);
+            } else {
+                unsigned char end = END_OF_CHILDREN;
+                append(&end, 1);
+            }
+            break;
+        }
+        case STRING_NODE:
+            append(node->string_value, strlen(node->string_value) + 1);
+            break;
+        case NUMBER_NODE:
+            append(&node->number_value, sizeof(node->number_value));
+            break;
+        case BOOLEAN_NODE: {
+            unsigned char value = node->boolean_value != 0;
+            append(&value, 1);
+            break;
+        }
+        case NULL_NODE:
+            break;
+    }
+}
+
+static unsigned long hash_bytes(const unsigned char *data, size_t size) {
+    unsigned long hash = 0xCBF29CE484222325UL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001B3UL;
+    }
+    return hash;
+}
+
+int dedup_lookup(ASTNode *object) {
+    scratch_size = 0;
+    encode_subtree(object);
+    scratch_hash = hash_bytes(scratch, scratch_size);
+
+    DedupEntry *bucket = &entries[(scratch_hash % num_buckets) * BUCKET_WAYS];
+    for (int i = 0; i < BUCKET_WAYS; i++) {
+        if (bucket[i].encoding && bucket[i].hash == scratch_hash && bucket[i].size == scratch_size &&
+            memcmp(bucket[i].encoding, scratch, scratch_size) == 0) {
+            return bucket[i].id;
+        }
+    }
+    return 0;
+}
+
+static void evict(DedupEntry *entry) {
+    stored_bytes -= entry->size;
+    free(entry->encoding);
+    entry->encoding = NULL;
+    entry->size = 0;
+}
+
+void dedup_insert(int id) {
+    unsigned long b = scratch_hash % num_buckets;
+    DedupEntry *bucket = &entries[b * BUCKET_WAYS];
+
+    int way = -1;
+    for (int i = 0; i < BUCKET_WAYS; i++) {
+        if (!bucket[i].encoding) {
+            way = i;
+            break;
+        }
+    }
+    if (way < 0) {
+        // Bucket full: evict round-robin, i.e. the oldest entry
+        way = bucket_victim[b];
+        bucket_victim[b] = (way + 1) % BUCKET_WAYS;
+        evict(&bucket[way]);
+    }
+    // Subtrees that would take the index over its byte budget are not indexed
+    if (stored_bytes + (long)scratch_size > DEDUP_MAX_BYTES) return;
+
+    bucket[way].encoding = malloc(scratch_size);
+    if (!bucket[way].encoding) {
+        perror("Failed to allocate dedup entry");
+        exit(1);
+    }
+    memcpy(bucket[way].encoding, scratch, scratch_size);
+    bucket[way].size = scratch_size;
+    bucket[way].hash = scratch_hash;
+    bucket[way].id = id;
+    stored_bytes += scratch_size;
+}
+
+void dedup_free(void) {
+    for (unsigned long i = 0; i < num_buckets * BUCKET_WAYS; i++) {
+        free(entries[i].encoding);
+    }
+    free(entries);
+    free(bucket_victim);
+    free(scratch);
+    entries = NULL;
+    bucket_victim = NULL;
+    num_buckets = 0;
+    stored_bytes = 0;
+    scratch = NULL;
+    scratch_size = 0;
+    scratch_capacity = 0;
+}
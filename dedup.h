@@ -0,0 +1,53 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "ast.h"
+
+#define DEFAULT_DEDUP_CAPACITY 65536
+// Total size of the subtree encodings the index may hold
+#define DEDUP_MAX_BYTES (64L * 1024 * 1024)
+
+/**
+ * Enables deduplication of repeated nested objects. The index holds at most
+ * `capacity` subtrees (rounded up to a power of two) and DEDUP_MAX_BYTES of
+ * encoded content; when a bucket is full the oldest entry in it is evicted,
+ * so memory stays bounded on any input.
+ *
+ * Entries own a compact encoding of their subtree rather than pointing into
+ * the document, so the index can outlive the document and match objects
+ * across the documents of a server session.
+ *
+ * @param capacity Maximum number of indexed subtrees (0 disables deduplication).
+ */
+void dedup_init(int capacity);
+
+/**
+ * Returns non-zero if deduplication is enabled.
+ */
+int dedup_enabled(void);
+
+/**
+ * Looks up a previously emitted subtree with identical content (keys, value
+ * types and values). Pairs added during CSV generation (e.g. "seq") are
+ * ignored. Hash matches are verified against the stored encoding.
+ *
+ * @param object The subtree to look up.
+ * @return The row id the subtree was written with, or 0 if it is not indexed.
+ */
+int dedup_lookup(ASTNode *object);
+
+/**
+ * Records the row id of the subtree passed to the last dedup_lookup() call,
+ * which must have returned 0. The index keeps its own copy of the subtree's
+ * encoding.
+ *
+ * @param id The row id of the subtree.
+ */
+void dedup_insert(int id);
+
+/**
+ * Frees the index and disables deduplication.
+ */
+void dedup_free(void);
+
+#endif
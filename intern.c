@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "intern.h"
+
+#define INITIAL_BUCKETS 256
+
+typedef struct InternedKey {
+    struct InternedKey *next;  // Next key in the same bucket
+    unsigned int hash;
+    int id;
+    int flags;
+    char text[];
+} InternedKey;
+
+static InternedKey **buckets = NULL;
+static unsigned int num_buckets = 0;
+static int num_keys = 0;
+
+static unsigned int hash_key(const char *key) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static InternedKey *entry_for(const char *key) {
+    return (InternedKey *)(key - offsetof(InternedKey, text));
+}
+
+static void grow_buckets(void) {
+    unsigned int new_size = num_buckets ? num_buckets * 2 : INITIAL_BUCKETS;
+    InternedKey **new_buckets = calloc(new_size, sizeof(InternedKey *));
+    if (!new_buckets) {
+        perror("Failed to allocate key intern table");
+        exit(1);
+    }
+
+    for (unsigned int i = 0; i < num_buckets; i++) {
+        InternedKey *entry = buckets[i];
+        while (entry) {
+            InternedKey *next = entry->next;
+            unsigned int slot = entry->hash & (new_size - 1);
+            entry->next = new_buckets[slot];
+            new_buckets[slot] = entry;
+            entry = next;
+        }
+    }
+
+    free(buckets);
+    buckets = new_buckets;
+    num_buckets = new_size;
+}
+
+const char *intern_key(const char *key) {
+    if (!buckets) grow_buckets();
+
+    unsigned int hash = hash_key(key);
+    for (InternedKey *entry = buckets[hash & (num_buckets - 1)]; entry; entry = entry->next) {
+        if (entry->hash == hash && strcmp(entry->text, key) == 0) {
+            return entry->text;
+        }
+    }
+
+    size_t len = strlen(key);
+    InternedKey *entry = malloc(sizeof(InternedKey) + len + 1);
+    if (!entry) {
+        perror("Failed to allocate interned key");
+        exit(1);
+    }
+    memcpy(entry->text, key, len + 1);
+    entry->hash = hash;
+    entry->id = ++num_keys;
+    entry->flags = 0;
+    if (strcmp(key, "id") == 0) {
+        entry->flags |= KEY_IS_ID;
+    } else if (len > 3 && strcmp(key + len - 3, "_id") == 0) {
+        entry->flags |= KEY_IS_FOREIGN_KEY;
+    }
+
+    if ((unsigned int)num_keys > num_buckets) grow_buckets();
+    unsigned int slot = hash & (num_buckets - 1);
+    entry->next = buckets[slot];
+    buckets[slot] = entry;
+
+    return entry->text;
+}
+
+int interned_key_id(const char *key) {
+    return entry_for(key)->id;
+}
+
+int interned_key_flags(const char *key) {
+    return entry_for(key)->flags;
+}
+
+void free_interned_keys(void) {
+    for (unsigned int i = 0; i < num_buckets; i++) {
+        InternedKey *entry = buckets[i];
+        while (entry) {
+            InternedKey *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(buckets);
+    buckets = NULL;
+    num_buckets = 0;
+    num_keys = 0;
+}
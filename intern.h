@@ -0,0 +1,37 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+// Flags computed once per distinct key when it is interned
+#define KEY_IS_ID 1           // The key is exactly "id"
+#define KEY_IS_FOREIGN_KEY 2  // The key ends in "_id" (and is not "id" itself)
+
+/**
+ * Returns the unique interned copy of a key. Two keys with the same text always
+ * intern to the same pointer, so interned keys can be compared with ==.
+ * The returned string lives until free_interned_keys() is called.
+ *
+ * @param key The key text to intern.
+ * @return The interned key.
+ */
+const char *intern_key(const char *key);
+
+/**
+ * Returns the small integer id assigned to an interned key (ids start at 1).
+ *
+ * @param key A key previously returned by intern_key().
+ */
+int interned_key_id(const char *key);
+
+/**
+ * Returns the KEY_IS_* flags of an interned key.
+ *
+ * @param key A key previously returned by intern_key().
+ */
+int interned_key_flags(const char *key);
+
+/**
+ * Frees every interned key. Any pointer returned by intern_key() is invalid afterwards.
+ */
+void free_interned_keys(void);
+
+#endif
@@ -0,0 +1,46 @@
+#!/usr/bin/env python3
+"""Sends JSON documents to a running `json2relcsv --serve SOCKET` server.
+
+Usage: json2relcsv_client.py SOCKET FILE [FILE ...]
+
+Each file is sent as one frame (its length in bytes, a newline, then the
+JSON text) and the server's reply ("ok <latency_us>" or "error <latency_us>")
+is printed. Pass "-" as FILE to read a document from stdin.
+"""
+import socket
+import sys
+
+
+def read_reply(sock_file):
+    line = sock_file.readline()
+    if not line:
+        sys.exit("server closed the connection")
+    return line.decode().strip()
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit(__doc__)
+
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(sys.argv[1])
+    sock_file = sock.makefile("rb")
+
+    failed = False
+    for path in sys.argv[2:]:
+        if path == "-":
+            data = sys.stdin.buffer.read()
+        else:
+            with open(path, "rb") as f:
+                data = f.read()
+        sock.sendall(b"%d\n" % len(data) + data)
+        reply = read_reply(sock_file)
+        print("%s: %s" % (path, reply))
+        failed = failed or not reply.startswith("ok")
+
+    sock.close()
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
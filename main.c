@@ -2,9 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <time.h>
 #include "ast.h"
 #include "parser.tab.h"  // Bison header
 #include "csv.h"
+#include "intern.h"
+#include "dedup.h"
+#include "tape.h"
+#include "serve.h"
 
 // External declarations
 extern FILE *yyin;
@@ -13,15 +18,35 @@ extern ASTNode *ast_root;
 
 void print_usage() {
     printf("Usage: json2relcsv <input.json> [--print-ast] [--out-dir DIR]\n");
+    printf("                   [--shards N] [--shard-key id|parent]\n");
+    printf("                   [--roll-rows N] [--roll-bytes N]\n");
+    printf("                   [--dedup] [--dedup-capacity N] [--threads N]\n");
+    printf("                   [--tape] [--stats]\n");
+    printf("       json2relcsv --serve SOCKET|- [--out-dir DIR] [--flush-bytes N] [--flush-ms N] [options]\n");
     exit(1);
 }
 
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 2) print_usage();
 
     char *input_file = NULL;
     int print_ast_flag = 0;
     char *out_dir = ".";
+    CSVOutputOptions output_options = { 1, SHARD_BY_ID, 0, 0 };
+    int dedup_flag = 0;
+    int dedup_capacity = DEFAULT_DEDUP_CAPACITY;
+    int threads = 1;
+    int tape_flag = 0;
+    int stats_flag = 0;
+    char *serve_path = NULL;
+    long flush_bytes = DEFAULT_FLUSH_BYTES;
+    int flush_ms = DEFAULT_FLUSH_MS;
 
     // Parse command-line arguments
     for (int i = 1; i < argc; i++) {
@@ -30,6 +55,45 @@ int main(int argc, char *argv[]) {
         } else if (strcmp(argv[i], "--out-dir") == 0) {
             if (i + 1 < argc) out_dir = argv[++i];
             else print_usage();
+        } else if (strcmp(argv[i], "--shards") == 0) {
+            if (i + 1 < argc) output_options.num_shards = atoi(argv[++i]);
+            else print_usage();
+            if (output_options.num_shards < 1) print_usage();
+        } else if (strcmp(argv[i], "--shard-key") == 0) {
+            if (i + 1 >= argc) print_usage();
+            i++;
+            if (strcmp(argv[i], "id") == 0) output_options.shard_key = SHARD_BY_ID;
+            else if (strcmp(argv[i], "parent") == 0) output_options.shard_key = SHARD_BY_PARENT;
+            else print_usage();
+        } else if (strcmp(argv[i], "--roll-rows") == 0) {
+            if (i + 1 < argc) output_options.roll_rows = atol(argv[++i]);
+            else print_usage();
+        } else if (strcmp(argv[i], "--roll-bytes") == 0) {
+            if (i + 1 < argc) output_options.roll_bytes = atol(argv[++i]);
+            else print_usage();
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            dedup_flag = 1;
+        } else if (strcmp(argv[i], "--dedup-capacity") == 0) {
+            if (i + 1 < argc) dedup_capacity = atoi(argv[++i]);
+            else print_usage();
+            if (dedup_capacity < 1) print_usage();
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            if (i + 1 < argc) threads = atoi(argv[++i]);
+            else print_usage();
+            if (threads < 1) print_usage();
+        } else if (strcmp(argv[i], "--tape") == 0) {
+            tape_flag = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats_flag = 1;
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            if (i + 1 < argc) serve_path = argv[++i];
+            else print_usage();
+        } else if (strcmp(argv[i], "--flush-bytes") == 0) {
+            if (i + 1 < argc) flush_bytes = atol(argv[++i]);
+            else print_usage();
+        } else if (strcmp(argv[i], "--flush-ms") == 0) {
+            if (i + 1 < argc) flush_ms = atoi(argv[++i]);
+            else print_usage();
         } else if (!input_file) {
             input_file = argv[i];
         } else {
@@ -37,8 +101,33 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    // The capacity only sizes the index; --dedup is what enables it
+    if (!dedup_flag) dedup_capacity = 0;
+
+    // Dedup ids depend on the order objects are seen, so it always runs single-threaded
+    if (dedup_flag && threads > 1) print_usage();
+
+    // Server mode: keep schemas and table files open across documents
+    if (serve_path) {
+        if (input_file || print_ast_flag) print_usage();
+        if (tape_flag && (dedup_flag || threads > 1)) print_usage();
+
+        ServeOptions serve_options = { serve_path, out_dir, tape_flag, dedup_capacity,
+                                       flush_bytes, flush_ms, stats_flag };
+        set_csv_output_options(&output_options);
+        set_csv_threads(threads);
+        int status = serve(&serve_options);
+        close_csv_tables(out_dir);
+        set_csv_threads(1);
+        free_interned_keys();
+        return status;
+    }
+
     if (!input_file) print_usage();
 
+    // The tape path has no AST to print and always runs single-threaded without dedup
+    if (tape_flag && (print_ast_flag || dedup_flag || threads > 1)) print_usage();
+
     // Open input file
     FILE *input = fopen(input_file, "r");
     if (!input) {
@@ -47,16 +136,27 @@ int main(int argc, char *argv[]) {
     }
     yyin = input;
 
-    // Parse JSON input
-    if (yyparse() != 0) {
+    // Parse JSON input, either into a tape or with the Bison parser into an AST
+    double parse_start = now_seconds();
+    Tape *tape = NULL;
+    if (tape_flag) {
+        tape = parse_json_to_tape(input);
+    } else if (yyparse() != 0) {
         fprintf(stderr, "Parsing failed.\n");
         fclose(input);
         return 1;
     }
     fclose(input);
+    double parse_seconds = now_seconds() - parse_start;
+
+    // Measured before generation, which adds "seq" pairs to the AST
+    size_t document_bytes = 0;
+    if (stats_flag) {
+        document_bytes = tape ? tape_memory_usage(tape) : ast_memory_usage(ast_root);
+    }
 
     // Check if AST was created
-    if (!ast_root) {
+    if (!tape && !ast_root) {
         fprintf(stderr, "Error: AST root is NULL after parsing. Likely parsing failed or no AST node was created.\n");
         return 1;
     }
@@ -67,11 +167,28 @@ int main(int argc, char *argv[]) {
         print_ast(ast_root, 0);
     }
 
-    // Generate CSV output (No return value check, just call the function)
-    generate_csv(ast_root, out_dir);
+    // Generate CSV output
+    set_csv_output_options(&output_options);
+    dedup_init(dedup_capacity);
+    set_csv_threads(threads);
+    double generate_start = now_seconds();
+    int status = tape ? generate_csv_from_tape(tape, out_dir) : generate_csv(ast_root, out_dir);
+    close_csv_tables(out_dir);
+    double generate_seconds = now_seconds() - generate_start;
+    dedup_free();
+    set_csv_threads(1);
+
+    if (stats_flag) {
+        fprintf(stderr, "representation: %s\n", tape ? "tape" : "ast");
+        fprintf(stderr, "document bytes: %zu\n", document_bytes);
+        fprintf(stderr, "parse seconds: %.6f\n", parse_seconds);
+        fprintf(stderr, "generate seconds: %.6f\n", generate_seconds);
+    }
 
     // Clean up
+    free_tape(tape);
     free_ast(ast_root);
+    free_interned_keys();
 
-    return 0;
+    return status == 0 ? 0 : 1;
 }
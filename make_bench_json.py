@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+"""Writes a synthetic orders document for comparing the AST and tape paths.
+
+Usage: make_bench_json.py [ORDERS [ITEMS [SEED]]] > bench.json
+
+The document has ORDERS orders (default 2000), each with a nested customer
+object, a scalar tag array and ITEMS line items (default 40) holding a
+nested product object. The output is deterministic for a given SEED.
+"""
+import json
+import random
+import sys
+
+
+def make_order(rng, order_id, num_items, customers):
+    return {
+        "id": order_id,
+        "customer_id": order_id % len(customers),
+        "note": 'rush, "fragile"' if order_id % 7 == 0 else "standard",
+        "paid": order_id % 3 != 0,
+        "customer": dict(customers[order_id % len(customers)]),
+        "tags": ["t%d" % (order_id % 5), rng.choice(["web", "store", "phone"])],
+        "items": [
+            {
+                "sku": "S%d" % j,
+                "qty": rng.randrange(1, 10),
+                "gift": j % 4 == 0,
+                "coupon": None,
+                "product": {"sku": "S%d" % j, "price": round(rng.uniform(1, 500), 2)},
+            }
+            for j in range(num_items)
+        ],
+    }
+
+
+def main():
+    if len(sys.argv) > 4:
+        sys.exit(__doc__)
+    num_orders = int(sys.argv[1]) if len(sys.argv) > 1 else 2000
+    num_items = int(sys.argv[2]) if len(sys.argv) > 2 else 40
+    rng = random.Random(int(sys.argv[3]) if len(sys.argv) > 3 else 1)
+
+    customers = [
+        {"id": i, "name": "customer%d" % i, "tier": rng.choice(["gold", "silver"])}
+        for i in range(20)
+    ]
+    orders = [make_order(rng, i, num_items, customers) for i in range(num_orders)]
+    json.dump({"batch": 1, "orders": orders}, sys.stdout, indent=1)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()
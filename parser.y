@@ -10,7 +10,7 @@ ASTNode *make_string(char *value);
 ASTNode *make_number(double value);
 ASTNode *make_bool(int value);
 ASTNode *make_null();
-ASTNode *make_pair(char *key, ASTNode *value);
+ASTNode *make_pair(const char *key, ASTNode *value);
 ASTNode *make_pair_list(ASTNode *pair, ASTNode *next);
 ASTNode *make_array_list(ASTNode *value, ASTNode *next);
 
@@ -38,9 +38,15 @@ extern ASTNode *ast_root;
 %token <boolean> BOOLEAN
 %token TRUE FALSE NULLVAL
 %token LBRACE RBRACE LBRACKET RBRACKET COLON COMMA
+%token LEX_ERROR  // Returned by the scanner after reporting a lexical error
 
 // Map TRUE/FALSE tokens to BOOLEAN type
-%type <node_val> json value object array members elements pair
+%type <node_val> value object array members elements pair
+
+// Free the partial document when a syntax error discards it. `json` has no
+// value type so the finished tree in ast_root is never destroyed.
+%destructor { free_ast($$); } <node_val>
+%destructor { free($$); } <str_val>
 
 %%
 
@@ -51,7 +57,7 @@ json:
 value:
       object            { $$ = $1; }
     | array             { $$ = $1; }
-    | STRING            { $$ = make_string($1); }
+    | STRING            { $$ = make_string($1); free($1); }
     | NUMBER            { $$ = make_number($1); }
     | TRUE              { $$ = make_bool(1); }
     | FALSE             { $$ = make_bool(0); }
@@ -69,7 +75,7 @@ members:
 ;
 
 pair:
-    STRING COLON value         { $$ = make_pair($1, $3); }
+    STRING COLON value         { $$ = make_pair($1, $3); free($1); }
 ;
 
 array:
@@ -84,8 +90,18 @@ elements:
 
 %%
 
+int parse_errors_recoverable = 0;
+
+// Called once an error has been reported
+void parse_failed(void) {
+    if (!parse_errors_recoverable) exit(EXIT_FAILURE);
+}
+
 void yyerror(const char *s) {
     extern int line_num, col_num;
-    fprintf(stderr, "Error: %s at line %d, column %d\n", s, line_num, col_num);
-    exit(EXIT_FAILURE);
+    // The scanner has already reported its own errors
+    if (yychar != LEX_ERROR) {
+        fprintf(stderr, "Error: %s at line %d, column %d\n", s, line_num, col_num);
+    }
+    parse_failed();
 }
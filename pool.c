@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "pool.h"
+
+struct ThreadPool {
+    pthread_t *threads;
+    int num_workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    unsigned long generation;  // Bumped for every pool_run() call
+    int shutting_down;
+
+    PoolTaskFn fn;
+    void *arg;
+    int num_tasks;
+    int next_task;     // Claimed with an atomic increment
+    int busy_workers;  // Workers still running tasks of the current generation
+};
+
+static void run_tasks(ThreadPool *pool) {
+    for (;;) {
+        int task = __atomic_fetch_add(&pool->next_task, 1, __ATOMIC_RELAXED);
+        if (task >= pool->num_tasks) break;
+        pool->fn(pool->arg, task);
+    }
+}
+
+static void *worker_main(void *data) {
+    ThreadPool *pool = data;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == seen && !pool->shutting_down) {
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        }
+        if (pool->shutting_down) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_tasks(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy_workers == 0) {
+            pthread_cond_signal(&pool->work_done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+ThreadPool *pool_create(int num_threads) {
+    ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+    if (!pool) {
+        perror("Failed to allocate thread pool");
+        exit(1);
+    }
+
+    pool->num_workers = num_threads > 1 ? num_threads - 1 : 0;
+    pool->threads = malloc((pool->num_workers + 1) * sizeof(pthread_t));
+    if (!pool->threads) {
+        perror("Failed to allocate thread pool");
+        exit(1);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+
+    for (int i = 0; i < pool->num_workers; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+            perror("Failed to start worker thread");
+            exit(1);
+        }
+    }
+    return pool;
+}
+
+void pool_run(ThreadPool *pool, int num_tasks, PoolTaskFn fn, void *arg) {
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->num_tasks = num_tasks;
+    pool->next_task = 0;
+    pool->busy_workers = pool->num_workers;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_tasks(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy_workers > 0) {
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(ThreadPool *pool) {
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutting_down = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->work_done);
+    free(pool->threads);
+    free(pool);
+}
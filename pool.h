@@ -0,0 +1,33 @@
+#ifndef POOL_H
+#define POOL_H
+
+typedef struct ThreadPool ThreadPool;
+
+/**
+ * Runs one task. Called concurrently from several threads with distinct indexes.
+ *
+ * @param arg The argument passed to pool_run().
+ * @param task_index The index of the task, in [0, num_tasks).
+ */
+typedef void (*PoolTaskFn)(void *arg, int task_index);
+
+/**
+ * Starts a pool of worker threads. The calling thread also runs tasks during
+ * pool_run(), so a pool for N threads starts N - 1 workers.
+ *
+ * @param num_threads Total number of threads running tasks (at least 1).
+ */
+ThreadPool *pool_create(int num_threads);
+
+/**
+ * Runs tasks 0 .. num_tasks - 1 and returns once all of them have finished.
+ * Idle threads claim the next unclaimed task, so uneven tasks balance out.
+ */
+void pool_run(ThreadPool *pool, int num_tasks, PoolTaskFn fn, void *arg);
+
+/**
+ * Stops and joins the worker threads and frees the pool.
+ */
+void pool_destroy(ThreadPool *pool);
+
+#endif
@@ -1,25 +1,43 @@
 #include "schema.h"
+#include "intern.h"
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #define MAX_SCHEMAS 100
 #define MAX_COLUMNS 100
 
-// Static variables for schema management
-static Schema schemas[MAX_SCHEMAS];
+// The registry grows in chunks of SCHEMA_CHUNK_SIZE schemas up to
+// MAX_OBJECT_SCHEMAS; past that, lookups of new shapes fail
+#define SCHEMA_CHUNK_SIZE 64
+#define MAX_OBJECT_SCHEMAS (SCHEMA_CHUNK_SIZE * 4096)
+
+// Static variables for schema management. Schemas never move once created,
+// so lookups read the published prefix [0 .. num_schemas) without locking;
+// creating a schema takes schema_lock and publishes it by storing
+// num_schemas with release ordering.
+static Schema *schema_chunks[MAX_OBJECT_SCHEMAS / SCHEMA_CHUNK_SIZE];
 static int num_schemas = 0;
 static int schema_counter = 1;
+static pthread_mutex_t schema_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static Schema *get_schema_locked(ASTNode *object);
+
+static Schema *schema_at(int index) {
+    return &schema_chunks[index / SCHEMA_CHUNK_SIZE][index % SCHEMA_CHUNK_SIZE];
+}
 
 static Schema junction_schemas[MAX_SCHEMAS];
 static int num_junction_schemas = 0;
 
-ASTNode *find_pair_in_object(ASTNode *object, const char *key) {
+// Looks up a key that is already interned, comparing pointers only
+ASTNode *find_pair_by_interned_key(ASTNode *object, const char *key) {
     if (!object || object->node_type != OBJECT_NODE) return NULL;
-    
+
     ASTNode *pair = object->children;
     while (pair) {
-        if (pair->node_type == PAIR_NODE && strcmp(pair->key, key) == 0) {
+        if (pair->node_type == PAIR_NODE && pair->key == key) {
             return pair;
         }
         pair = pair->next;
@@ -27,35 +45,67 @@ ASTNode *find_pair_in_object(ASTNode *object, const char *key) {
     return NULL;
 }
 
-int object_has_same_structure(ASTNode *obj1, ASTNode *obj2) {
-    if (!obj1 || !obj2 || obj1->node_type != OBJECT_NODE || obj2->node_type != OBJECT_NODE) {
-        return 0;
+static int object_has_id_key(ASTNode *object) {
+    for (ASTNode *pair = object->children; pair; pair = pair->next) {
+        if (pair->node_type == PAIR_NODE && (interned_key_flags(pair->key) & KEY_IS_ID)) {
+            return 1;
+        }
     }
-    
-    // Count keys in both objects
-    int count1 = 0, count2 = 0;
-    ASTNode *pair;
-    
-    for (pair = obj1->children; pair; pair = pair->next) count1++;
-    for (pair = obj2->children; pair; pair = pair->next) count2++;
-    
-    if (count1 != count2) return 0;
-    
-    // Check all keys in obj1 exist in obj2 with same types
-    for (pair = obj1->children; pair; pair = pair->next) {
-        ASTNode *pair2 = find_pair_in_object(obj2, pair->key);
-        if (!pair2) return 0;
-        
-        if (pair->children && pair2->children) {
-            if (pair->children->node_type != pair2->children->node_type) {
-                return 0;
-            }
+    return 0;
+}
+
+static unsigned long signature_term(const char *key, NodeType type) {
+    unsigned long h = (unsigned long)interned_key_id(key) * 31 + type;
+    h *= 0x9E3779B97F4A7C15UL;
+    return h ^ (h >> 29);
+}
+
+// Order-independent hash of an object's keys and value types. Objects with the
+// same structure always have the same signature, so schemas whose signature
+// differs can be skipped without comparing keys.
+unsigned long object_signature(ASTNode *object) {
+    unsigned long signature = 0;
+    for (ASTNode *pair = object->children; pair; pair = pair->next) {
+        if (pair->node_type != PAIR_NODE) continue;
+        signature += signature_term(pair->key, pair->children ? pair->children->node_type : 0);
+    }
+    return signature;
+}
+
+static int schema_has_column(const Schema *schema, const char *key, NodeType type) {
+    for (int i = 0; i < schema->num_columns; i++) {
+        if (schema->columns[i] == key && schema->column_types[i] == type) {
+            return 1;
         }
     }
-    
-    return 1;
+    return 0;
 }
-// Detect foreign keys in nested objects or arrays
+
+// True if the object has exactly the schema's keys with the same value types.
+// Tested against the schema's columns, so it works for schemas from either
+// representation
+static int schema_matches_object(const Schema *schema, ASTNode *object) {
+    int count = 0;
+    for (ASTNode *pair = object->children; pair; pair = pair->next) {
+        if (pair->node_type != PAIR_NODE) continue;
+        if (!schema_has_column(schema, pair->key, pair->children ? pair->children->node_type : 0)) {
+            return 0;
+        }
+        count++;
+    }
+    return count == schema->num_columns;
+}
+
+// Records a foreign key; a schema keeps at most MAX_COLUMNS of them and
+// drops the rest
+static void add_foreign_key(Schema *schema, const char *column_name, Schema *referenced_schema) {
+    if (schema->num_foreign_keys >= MAX_COLUMNS) return;
+    schema->foreign_keys[schema->num_foreign_keys].column_name = column_name;
+    schema->foreign_keys[schema->num_foreign_keys].referenced_schema = referenced_schema;
+    schema->num_foreign_keys++;
+}
+
+// Detect foreign keys in nested objects or arrays (called with schema_lock held)
 void detect_nested_fk(Schema *schema, ASTNode *object) {
     ASTNode *pair = object->children;
     while (pair) {
@@ -66,11 +116,9 @@ void detect_nested_fk(Schema *schema, ASTNode *object) {
             if (pair->children && pair->children->node_type == OBJECT_NODE) {
                 ASTNode *nested_object = pair->children;
                 // Check if this nested object contains an FK
-                if (find_pair_in_object(nested_object, "id")) {
+                if (object_has_id_key(nested_object)) {
                     // Add this as a foreign key column to the parent schema
-                    schema->foreign_keys[schema->num_foreign_keys].column_name = strdup(key);
-                    schema->foreign_keys[schema->num_foreign_keys].referenced_schema = get_schema_for_object(nested_object);
-                    schema->num_foreign_keys++;
+                    add_foreign_key(schema, key, get_schema_locked(nested_object));
                 }
             }
             // If the value is an array of objects, look for FK relationships in each object
@@ -79,11 +127,9 @@ void detect_nested_fk(Schema *schema, ASTNode *object) {
                 while (array_item) {
                     if (array_item->node_type == OBJECT_NODE) {
                         // Check if this object contains an FK
-                        if (find_pair_in_object(array_item, "id")) {
+                        if (object_has_id_key(array_item)) {
                             // Add this as a foreign key column to the parent schema
-                            schema->foreign_keys[schema->num_foreign_keys].column_name = strdup(key);
-                            schema->foreign_keys[schema->num_foreign_keys].referenced_schema = get_schema_for_object(array_item);
-                            schema->num_foreign_keys++;
+                            add_foreign_key(schema, key, get_schema_locked(array_item));
                         }
                     }
                     array_item = array_item->next;
@@ -94,87 +140,254 @@ void detect_nested_fk(Schema *schema, ASTNode *object) {
     }
 }
 
-// Updated get_schema_for_object() to handle nested FK detection
-Schema *get_schema_for_object(ASTNode *object) {
-    if (!object || object->node_type != OBJECT_NODE) return NULL;
-
-    // Count columns
-    int num_cols = 0;
-    ASTNode *pair = object->children;
-    while (pair) {
-        if (pair->node_type == PAIR_NODE) {
-            num_cols++;
+static Schema *find_schema(ASTNode *object, unsigned long signature, int from, int to) {
+    for (int i = from; i < to; i++) {
+        Schema *schema = schema_at(i);
+        if (schema->signature == signature && schema_matches_object(schema, object)) {
+            return schema;
         }
-        pair = pair->next;
     }
+    return NULL;
+}
 
-    // Reuse existing schema
-    for (int i = 0; i < num_schemas; i++) {
-        if (object_has_same_structure(object, schemas[i].prototype)) {
-            return &schemas[i];
-        }
+// Starts a schema in the next free slot; it is not visible to lookups until
+// publish_schema() is called. Returns NULL once the registry is full.
+// Called with schema_lock held.
+static Schema *new_schema(int num_cols, unsigned long signature) {
+    if (num_schemas >= MAX_OBJECT_SCHEMAS) {
+        fprintf(stderr, "Too many schemas\n");
+        return NULL;
     }
 
-    // Create new schema
-    if (num_schemas >= MAX_SCHEMAS) {
-        fprintf(stderr, "Too many schemas\n");
-        exit(1);
+    Schema **chunk = &schema_chunks[num_schemas / SCHEMA_CHUNK_SIZE];
+    if (!*chunk) {
+        // Published together with the first schema in it
+        *chunk = calloc(SCHEMA_CHUNK_SIZE, sizeof(Schema));
+        if (!*chunk) {
+            perror("Failed to allocate schemas");
+            exit(1);
+        }
     }
 
-    Schema *schema = &schemas[num_schemas++];
+    Schema *schema = schema_at(num_schemas);
     schema->name = malloc(32);
     snprintf(schema->name, 32, "table%d", schema_counter++);
     schema->columns = malloc(num_cols * sizeof(char *));
-    if (!schema->columns) {
+    schema->column_types = malloc(num_cols * sizeof(NodeType));
+    if (!schema->columns || !schema->column_types) {
         perror("Failed to allocate schema columns");
         exit(1);
     }
 
-    schema->num_columns = num_cols;
+    schema->num_columns = 0;
+    schema->signature = signature;
     schema->parent_id_column = NULL;
     schema->is_junction_table = 0;
-    schema->prototype = object;
 
     schema->primary_key = NULL;
     schema->num_foreign_keys = 0;
+    return schema;
+}
 
-    // Populate columns and detect PK/FKs
-    int i = 0;
-    pair = object->children;
-    while (pair) {
-        if (pair->node_type == PAIR_NODE) {
-            const char *key = pair->key;
-            schema->columns[i++] = strdup(key);
+// Appends a column and detects PK/FKs
+static void add_schema_column(Schema *schema, const char *key, NodeType type) {
+    int flags = interned_key_flags(key);
+    schema->columns[schema->num_columns] = key;
+    schema->column_types[schema->num_columns] = type;
+    schema->num_columns++;
 
-            // Detect primary key
-            if (strcmp(key, "id") == 0) {
-                schema->primary_key = strdup(key);
-            }
+    // Detect primary key
+    if (flags & KEY_IS_ID) {
+        schema->primary_key = key;
+    }
 
-            // Detect foreign keys
-            if (strlen(key) > 3 && strcmp(key + strlen(key) - 3, "_id") == 0 && strcmp(key, "id") != 0) {
-                // Attempt to find a referenced schema with PK = id
-                for (int j = 0; j < num_schemas; j++) {
-                    for (int k = 0; k < schemas[j].num_columns; k++) {
-                        if (strcmp(schemas[j].columns[k], "id") == 0) {
-                            schema->foreign_keys[schema->num_foreign_keys].column_name = strdup(key);
-                            schema->foreign_keys[schema->num_foreign_keys].referenced_schema = &schemas[j];
-                            schema->num_foreign_keys++;
-                            break;
-                        }
-                    }
-                }
+    // Detect foreign keys
+    if (flags & KEY_IS_FOREIGN_KEY) {
+        // Attempt to find a referenced schema with PK = id (including this one)
+        for (int i = 0; i <= num_schemas && schema->num_foreign_keys < MAX_COLUMNS; i++) {
+            Schema *other = schema_at(i);
+            if (other->primary_key) {
+                add_foreign_key(schema, key, other);
             }
         }
+    }
+}
+
+// Publishes the schema started by new_schema(), before nested schemas are
+// created so they are numbered after it
+static void publish_schema(void) {
+    __atomic_store_n(&num_schemas, num_schemas + 1, __ATOMIC_RELEASE);
+}
+
+// Creates a schema for an object that matched none of the first `checked`
+// schemas. Returns NULL if the registry is full. Called with schema_lock held.
+static Schema *create_schema(ASTNode *object, unsigned long signature, int checked) {
+    // Another thread may have created a matching schema since the caller looked
+    Schema *existing = find_schema(object, signature, checked, num_schemas);
+    if (existing) return existing;
+
+    // Count columns
+    int num_cols = 0;
+    ASTNode *pair = object->children;
+    while (pair) {
+        if (pair->node_type == PAIR_NODE) {
+            num_cols++;
+        }
         pair = pair->next;
     }
 
+    // Create new schema
+    Schema *schema = new_schema(num_cols, signature);
+    if (!schema) return NULL;
+
+    // Populate columns and detect PK/FKs
+    for (pair = object->children; pair; pair = pair->next) {
+        if (pair->node_type == PAIR_NODE) {
+            add_schema_column(schema, pair->key, pair->children ? pair->children->node_type : 0);
+        }
+    }
+
+    publish_schema();
+
     // Check for nested FKs (in objects or arrays)
     detect_nested_fk(schema, object);
 
     return schema;
 }
 
+static Schema *get_schema_locked(ASTNode *object) {
+    if (!object || object->node_type != OBJECT_NODE) return NULL;
+    return create_schema(object, object_signature(object), 0);
+}
+
+// Safe to call from several threads; inserts are serialized by schema_lock
+Schema *get_schema_for_object(ASTNode *object) {
+    if (!object || object->node_type != OBJECT_NODE) return NULL;
+
+    // Reuse existing schema
+    unsigned long signature = object_signature(object);
+    int count = __atomic_load_n(&num_schemas, __ATOMIC_ACQUIRE);
+    Schema *schema = find_schema(object, signature, 0, count);
+    if (schema) return schema;
+
+    pthread_mutex_lock(&schema_lock);
+    schema = create_schema(object, signature, count);
+    pthread_mutex_unlock(&schema_lock);
+
+    return schema;
+}
+
+static const char *seq_key(void) {
+    static const char *key = NULL;
+    if (!key) key = intern_key("seq");
+    return key;
+}
+
+// Tape objects that are array elements carry a virtual leading "seq" NUMBER
+// pair, mirroring the pair add_seq_to_object() inserts into AST objects
+static unsigned long tape_object_signature(const Tape *tape, unsigned int index, int with_seq) {
+    const TapeEntry *entries = tape->entries;
+    unsigned long signature = with_seq ? signature_term(seq_key(), NUMBER_NODE) : 0;
+    for (unsigned int pair = index + 1; pair < entries[index].next; pair = entries[pair].next) {
+        signature += signature_term(entries[pair].key, entries[pair + 1].type);
+    }
+    return signature;
+}
+
+static int schema_matches_tape(const Schema *schema, const Tape *tape, unsigned int index, int with_seq) {
+    const TapeEntry *entries = tape->entries;
+    int count = 0;
+    if (with_seq) {
+        if (!schema_has_column(schema, seq_key(), NUMBER_NODE)) return 0;
+        count++;
+    }
+    for (unsigned int pair = index + 1; pair < entries[index].next; pair = entries[pair].next) {
+        if (!schema_has_column(schema, entries[pair].key, entries[pair + 1].type)) return 0;
+        count++;
+    }
+    return count == schema->num_columns;
+}
+
+static Schema *find_tape_schema(const Tape *tape, unsigned int index, int with_seq,
+                                unsigned long signature, int from, int to) {
+    for (int i = from; i < to; i++) {
+        Schema *schema = schema_at(i);
+        if (schema->signature == signature && schema_matches_tape(schema, tape, index, with_seq)) {
+            return schema;
+        }
+    }
+    return NULL;
+}
+
+static Schema *get_tape_schema_locked(const Tape *tape, unsigned int index, int with_seq);
+
+// Tape counterpart of detect_nested_fk(). Array values never contribute
+// there (the loop starts at the array node itself), so only object values
+// are followed here.
+static void detect_nested_fk_tape(Schema *schema, const Tape *tape, unsigned int index) {
+    const TapeEntry *entries = tape->entries;
+    for (unsigned int pair = index + 1; pair < entries[index].next; pair = entries[pair].next) {
+        unsigned int value = pair + 1;
+        if (entries[value].type != OBJECT_NODE) continue;
+
+        for (unsigned int nested = value + 1; nested < entries[value].next; nested = entries[nested].next) {
+            if (interned_key_flags(entries[nested].key) & KEY_IS_ID) {
+                add_foreign_key(schema, entries[pair].key, get_tape_schema_locked(tape, value, 0));
+                break;
+            }
+        }
+    }
+}
+
+// Called with schema_lock held
+static Schema *create_tape_schema(const Tape *tape, unsigned int index, int with_seq,
+                                  unsigned long signature, int checked) {
+    Schema *existing = find_tape_schema(tape, index, with_seq, signature, checked, num_schemas);
+    if (existing) return existing;
+
+    const TapeEntry *entries = tape->entries;
+    int num_cols = with_seq ? 1 : 0;
+    for (unsigned int pair = index + 1; pair < entries[index].next; pair = entries[pair].next) {
+        num_cols++;
+    }
+
+    Schema *schema = new_schema(num_cols, signature);
+    if (!schema) return NULL;
+    if (with_seq) {
+        add_schema_column(schema, seq_key(), NUMBER_NODE);
+    }
+    for (unsigned int pair = index + 1; pair < entries[index].next; pair = entries[pair].next) {
+        add_schema_column(schema, entries[pair].key, entries[pair + 1].type);
+    }
+
+    publish_schema();
+
+    detect_nested_fk_tape(schema, tape, index);
+
+    return schema;
+}
+
+static Schema *get_tape_schema_locked(const Tape *tape, unsigned int index, int with_seq) {
+    return create_tape_schema(tape, index, with_seq, tape_object_signature(tape, index, with_seq), 0);
+}
+
+// Tape counterpart of get_schema_for_object(). Schemas are shared between
+// both representations.
+Schema *get_schema_for_tape_object(const Tape *tape, unsigned int index, int with_seq) {
+    if (tape->entries[index].type != OBJECT_NODE) return NULL;
+
+    unsigned long signature = tape_object_signature(tape, index, with_seq);
+    int count = __atomic_load_n(&num_schemas, __ATOMIC_ACQUIRE);
+    Schema *schema = find_tape_schema(tape, index, with_seq, signature, 0, count);
+    if (schema) return schema;
+
+    pthread_mutex_lock(&schema_lock);
+    schema = create_tape_schema(tape, index, with_seq, signature, count);
+    pthread_mutex_unlock(&schema_lock);
+
+    return schema;
+}
+
 
 
 Schema *get_junction_schema(const char *array_key) {
@@ -195,9 +408,9 @@ Schema *get_junction_schema(const char *array_key) {
     schema->name = strdup(array_key);
     schema->num_columns = 0;
     schema->columns = NULL;
+    schema->column_types = NULL;
     schema->parent_id_column = NULL;
     schema->is_junction_table = 1;
-    schema->prototype = NULL;
     
     return schema;
 }
@@ -211,36 +424,18 @@ void free_schema(Schema *schema) {
             free(schema->name);
         }
 
-        // Free column names
+        // Free the column arrays (column, primary and foreign key names are interned)
         if (schema->columns) {
-            for (int i = 0; i < schema->num_columns; i++) {
-                if (schema->columns[i]) {
-                    free(schema->columns[i]);
-                }
-            }
             free(schema->columns);
         }
-
-        // Free primary key
-        if (schema->primary_key) {
-            free(schema->primary_key);
-        }
-
-        // Free foreign keys
-        for (int i = 0; i < schema->num_foreign_keys; i++) {
-            if (schema->foreign_keys[i].column_name) {
-                free(schema->foreign_keys[i].column_name);
-            }
-        }
-
-        // If the schema has a prototype, it will be freed elsewhere (not shown here)
+        free(schema->column_types);
     }
 }
 
 // Free all schemas in the global schema list
 void free_all_schemas() {
     for (int i = 0; i < num_schemas; i++) {
-        free_schema(&schemas[i]);
+        free_schema(schema_at(i));
     }
     num_schemas = 0;
 }
@@ -2,37 +2,41 @@
 #define SCHEMA_H
 
 #include "ast.h"
+#include "tape.h"
 
 #define MAX_COLUMNS 100
 
 typedef struct Schema Schema;  // Forward declaration for FK struct
 
 typedef struct {
-    char *column_name;
+    const char *column_name;  // Interned
     Schema *referenced_schema;
 } ForeignKey;
 
 struct Schema {
     char *name;
-    char **columns;
+    const char **columns;  // Interned keys, compared by pointer
+    NodeType *column_types;  // Value type of each column
     int num_columns;
+    unsigned long signature;  // See object_signature()
     char *parent_id_column;
     int is_junction_table;
-    ASTNode *prototype;
 
     // Primary Key Support
     int has_primary_key;
-    char *primary_key;
+    const char *primary_key;  // Interned
 
     // Foreign Key Support
     ForeignKey foreign_keys[MAX_COLUMNS];
     int num_foreign_keys;
 };
 
+// Both return NULL for an object of a new shape once the registry is full
 Schema *get_schema_for_object(ASTNode *object);
+Schema *get_schema_for_tape_object(const Tape *tape, unsigned int index, int with_seq);
 Schema *get_junction_schema(const char *array_key);
-ASTNode *find_pair_in_object(ASTNode *object, const char *key);
-int object_has_same_structure(ASTNode *obj1, ASTNode *obj2);
+ASTNode *find_pair_by_interned_key(ASTNode *object, const char *key);
+unsigned long object_signature(ASTNode *object);
 void add_primary_key(Schema *schema, ASTNode *object);  // Optional utility
 
 #endif
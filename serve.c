@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "serve.h"
+#include "ast.h"
+#include "csv.h"
+#include "dedup.h"
+#include "tape.h"
+
+#define MAX_CLIENTS 64
+#define MAX_FRAME_BYTES (256L << 20)
+#define READ_CHUNK 65536
+
+extern int yyparse();
+extern void yyrestart(FILE *input);
+extern int line_num, col_num;
+
+typedef struct {
+    int in_fd;
+    int out_fd;
+    char *buffer;
+    size_t size;
+    size_t capacity;
+} Client;
+
+static volatile sig_atomic_t stop_requested = 0;
+// Written to by the signal handler so a signal arriving just before poll()
+// still wakes it (self-pipe)
+static int stop_pipe[2] = { -1, -1 };
+
+// Latency summary reported at shutdown
+static long num_requests = 0;
+static long num_errors = 0;
+static long total_latency_us = 0;
+static long max_latency_us = 0;
+
+static void handle_stop_signal(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    stop_requested = 1;
+    if (stop_pipe[1] >= 0) {
+        ssize_t ignored = write(stop_pipe[1], "x", 1);  // Pipe full means a wakeup is already pending
+        (void)ignored;
+    }
+    errno = saved_errno;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR && !stop_requested) continue;
+        if (n <= 0) return;  // The client went away or we are shutting down; the reply is dropped
+        data += n;
+        len -= n;
+    }
+}
+
+// Parses and writes one document. Returns 0 on success, -1 if it was rejected;
+// tables are left untouched by a rejected document.
+static int process_document(const ServeOptions *options, const char *data, size_t len) {
+    FILE *input = fmemopen((void *)data, len, "r");
+    if (!input) {
+        perror("Failed to open document buffer");
+        return -1;
+    }
+
+    Tape *tape = NULL;
+    ast_root = NULL;
+
+    // A rejected document's partial AST or tape is freed by the parser
+    yyrestart(input);
+    line_num = 1;
+    col_num = 1;
+    int failed;
+    if (options->use_tape) {
+        tape = parse_json_to_tape(input);
+        failed = !tape;
+    } else {
+        failed = yyparse() != 0;
+    }
+    fclose(input);
+    if (failed) {
+        // Set if the error came after the root value was complete
+        free_ast(ast_root);
+        ast_root = NULL;
+        return -1;
+    }
+
+    int status = tape ? generate_csv_from_tape(tape, options->out_dir)
+                      : generate_csv(ast_root, options->out_dir);
+
+    free_tape(tape);
+    free_ast(ast_root);
+    ast_root = NULL;
+    return status;
+}
+
+// Handles every complete frame in the client's buffer. Returns -1 if the
+// stream is malformed and the client should be dropped.
+static int process_frames(const ServeOptions *options, Client *client) {
+    size_t start = 0;
+
+    // Frames still buffered at shutdown are left unanswered
+    while (!stop_requested) {
+        char *newline = memchr(client->buffer + start, '\n', client->size - start);
+        if (!newline) break;
+
+        char *end;
+        long frame_len = strtol(client->buffer + start, &end, 10);
+        if (end != newline || frame_len < 0 || frame_len > MAX_FRAME_BYTES) {
+            fprintf(stderr, "Malformed frame header\n");
+            return -1;
+        }
+
+        size_t body = newline + 1 - client->buffer;
+        if (client->size - body < (size_t)frame_len) break;
+
+        double started = now_ms();
+        int status = process_document(options, client->buffer + body, frame_len);
+        long latency_us = (long)((now_ms() - started) * 1000.0);
+
+        char reply[64];
+        int n = snprintf(reply, sizeof(reply), "%s %ld\n", status == 0 ? "ok" : "error", latency_us);
+        write_all(client->out_fd, reply, n);
+
+        num_requests++;
+        if (status != 0) num_errors++;
+        total_latency_us += latency_us;
+        if (latency_us > max_latency_us) max_latency_us = latency_us;
+        if (options->log_latency) {
+            fprintf(stderr, "request: %s %zu bytes %ld us\n", status == 0 ? "ok" : "error",
+                    (size_t)frame_len, latency_us);
+        }
+
+        start = body + frame_len;
+    }
+
+    memmove(client->buffer, client->buffer + start, client->size - start);
+    client->size -= start;
+    return 0;
+}
+
+// Reads what is available from the client. Returns -1 once it should be dropped.
+static int read_client(const ServeOptions *options, Client *client) {
+    if (client->capacity - client->size < READ_CHUNK) {
+        client->capacity = client->capacity ? client->capacity * 2 : READ_CHUNK * 2;
+        client->buffer = realloc(client->buffer, client->capacity);
+        if (!client->buffer) {
+            perror("Failed to allocate client buffer");
+            exit(1);
+        }
+    }
+
+    ssize_t n = read(client->in_fd, client->buffer + client->size, client->capacity - client->size);
+    if (n < 0 && errno == EINTR) return 0;
+    if (n <= 0) return -1;
+
+    client->size += n;
+    return process_frames(options, client);
+}
+
+static int open_listener(const char *path) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+
+    // A socket left behind by an earlier server is replaced; anything else
+    // at the path is not ours to remove
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Not a socket, refusing to replace: %s\n", path);
+            return -1;
+        }
+        if (unlink(path) < 0) {
+            perror("Failed to remove old socket");
+            return -1;
+        }
+    } else if (errno != ENOENT) {
+        perror("Failed to check socket path");
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Failed to create socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("Failed to listen on socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int serve(const ServeOptions *options) {
+    int use_stdin = strcmp(options->socket_path, "-") == 0;
+    int listener = -1;
+
+    if (pipe(stop_pipe) < 0) {
+        perror("Failed to create signal pipe");
+        return 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(stop_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(stop_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_stop_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    Client clients[MAX_CLIENTS];
+    int num_clients = 0;
+
+    if (use_stdin) {
+        clients[num_clients++] = (Client){ STDIN_FILENO, STDOUT_FILENO, NULL, 0, 0 };
+    } else {
+        listener = open_listener(options->socket_path);
+        if (listener < 0) return 1;
+        fprintf(stderr, "Listening on %s\n", options->socket_path);
+    }
+
+    parse_errors_recoverable = 1;
+
+    // The index owns copies of what it stores, so repeated objects are
+    // matched across documents as well as within one
+    dedup_init(options->dedup_capacity);
+    double last_flush = now_ms();
+
+    while (!stop_requested) {
+        struct pollfd fds[MAX_CLIENTS + 2];
+        int nfds = 0;
+        for (int i = 0; i < num_clients; i++) {
+            fds[nfds].fd = clients[i].in_fd;
+            fds[nfds++].events = POLLIN;
+        }
+        int listener_slot = -1;
+        if (listener >= 0) {
+            listener_slot = nfds;
+            fds[nfds].fd = listener;
+            fds[nfds++].events = num_clients < MAX_CLIENTS ? POLLIN : 0;
+        }
+        fds[nfds].fd = stop_pipe[0];
+        fds[nfds++].events = POLLIN;
+
+        // Wake up in time to flush pending rows once they are flush_ms old
+        int timeout = -1;
+        if (csv_unflushed_bytes() > 0) {
+            double remaining = options->flush_ms - (now_ms() - last_flush);
+            timeout = remaining > 0 ? (int)remaining + 1 : 0;
+        }
+
+        int ready = poll(fds, nfds, timeout);
+        if (ready < 0 && errno != EINTR) {
+            perror("poll failed");
+            break;
+        }
+
+        if (ready > 0) {
+            // Walk clients backwards so dropping one does not skip another
+            for (int i = num_clients - 1; i >= 0; i--) {
+                if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+                if (read_client(options, &clients[i]) < 0) {
+                    if (use_stdin) {
+                        stop_requested = 1;  // End of the input stream
+                    } else {
+                        close(clients[i].in_fd);
+                    }
+                    free(clients[i].buffer);
+                    clients[i] = clients[--num_clients];
+                }
+            }
+
+            if (listener_slot >= 0 && (fds[listener_slot].revents & POLLIN)) {
+                int fd = accept(listener, NULL, NULL);
+                if (fd >= 0) {
+                    clients[num_clients++] = (Client){ fd, fd, NULL, 0, 0 };
+                }
+            }
+        }
+
+        if (csv_unflushed_bytes() > 0 &&
+            (csv_unflushed_bytes() >= options->flush_bytes || now_ms() - last_flush >= options->flush_ms)) {
+            flush_csv_tables();
+            last_flush = now_ms();
+        } else if (csv_unflushed_bytes() == 0) {
+            last_flush = now_ms();
+        }
+    }
+
+    for (int i = 0; i < num_clients; i++) {
+        if (!use_stdin) close(clients[i].in_fd);
+        free(clients[i].buffer);
+    }
+    if (listener >= 0) {
+        close(listener);
+        unlink(options->socket_path);
+    }
+    dedup_free();
+    for (int i = 0; i < 2; i++) {
+        close(stop_pipe[i]);
+        stop_pipe[i] = -1;
+    }
+
+    fprintf(stderr, "Shutting down after %ld requests (%ld rejected), latency mean %ld us, max %ld us\n",
+            num_requests, num_errors, num_requests ? total_latency_us / num_requests : 0, max_latency_us);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#define DEFAULT_FLUSH_BYTES (1L << 20)
+#define DEFAULT_FLUSH_MS 1000
+
+typedef struct {
+    const char *socket_path;  // Unix domain socket to listen on, or "-" for stdin/stdout
+    const char *out_dir;
+    int use_tape;             // Parse documents into a tape instead of an AST
+    int dedup_capacity;       // 0 disables --dedup; the index is kept across documents
+    long flush_bytes;         // Flush table files once this many bytes are pending
+    int flush_ms;             // ... or once the oldest pending bytes are this old
+    int log_latency;          // Also log every request's latency to stderr
+} ServeOptions;
+
+/**
+ * Runs the long-lived server until SIGINT/SIGTERM (or end of stdin). Schemas,
+ * ids and open table files persist across documents.
+ *
+ * Each document is sent as a frame: its length in bytes in decimal, a newline,
+ * then the JSON text. Every frame is answered with one line,
+ * "ok <latency_us>" or "error <latency_us>".
+ *
+ * The caller is responsible for the final close_csv_tables().
+ *
+ * @return 0 on a clean shutdown, 1 if the server could not start.
+ */
+int serve(const ServeOptions *options);
+
+#endif
@@ -0,0 +1,183 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include "tape.h"
+#include "intern.h"
+#include "parser.tab.h"
+
+extern FILE *yyin;
+extern int yylex();
+void yyerror(const char *s);
+
+// Deepest nesting accepted, matching the Bison parser's default YYMAXDEPTH, so
+// the recursive passes over the tape stay well within the stack
+#define TAPE_MAX_DEPTH 10000
+
+// Target of syntax errors while parse_json_to_tape() runs
+static jmp_buf tape_error;
+
+// Objects and arrays currently open
+static int depth;
+
+// Reports an unexpected token and abandons the tape. A string token's
+// value is owned by the parser and freed here.
+static void tape_syntax_error(int token) {
+    if (token == STRING) free(yylval.str_val);
+    if (token != LEX_ERROR) yyerror("syntax error");
+    longjmp(tape_error, 1);
+}
+
+static unsigned int push_entry(Tape *tape, NodeType type) {
+    if (tape->num_entries == tape->capacity) {
+        tape->capacity = tape->capacity ? tape->capacity * 2 : 1024;
+        tape->entries = realloc(tape->entries, tape->capacity * sizeof(TapeEntry));
+        if (!tape->entries) {
+            perror("Failed to allocate tape");
+            exit(1);
+        }
+    }
+
+    unsigned int index = tape->num_entries++;
+    TapeEntry *entry = &tape->entries[index];
+    entry->type = type;
+    entry->next = index + 1;
+    entry->string_offset = 0;
+    return index;
+}
+
+static size_t push_string(Tape *tape, const char *str) {
+    size_t len = strlen(str) + 1;
+    if (tape->strings_size + len > tape->strings_capacity) {
+        while (tape->strings_size + len > tape->strings_capacity) {
+            tape->strings_capacity = tape->strings_capacity ? tape->strings_capacity * 2 : 4096;
+        }
+        tape->strings = realloc(tape->strings, tape->strings_capacity);
+        if (!tape->strings) {
+            perror("Failed to allocate tape strings");
+            exit(1);
+        }
+    }
+
+    size_t offset = tape->strings_size;
+    memcpy(tape->strings + offset, str, len);
+    tape->strings_size += len;
+    return offset;
+}
+
+// Appends the value starting with `token`; containers are closed by patching
+// their `next` once all of their children have been appended
+static void parse_value(Tape *tape, int token) {
+    unsigned int index;
+
+    if ((token == LBRACE || token == LBRACKET) && depth == TAPE_MAX_DEPTH) {
+        yyerror("nesting too deep");
+        longjmp(tape_error, 1);
+    }
+
+    switch (token) {
+        case LBRACE:
+            index = push_entry(tape, OBJECT_NODE);
+            depth++;
+            token = yylex();
+            if (token != RBRACE) {
+                for (;;) {
+                    if (token != STRING) tape_syntax_error(token);
+                    unsigned int pair = push_entry(tape, PAIR_NODE);
+                    tape->entries[pair].key = intern_key(yylval.str_val);
+                    free(yylval.str_val);
+
+                    token = yylex();
+                    if (token != COLON) tape_syntax_error(token);
+                    parse_value(tape, yylex());
+                    tape->entries[pair].next = tape->num_entries;
+
+                    token = yylex();
+                    if (token == RBRACE) break;
+                    if (token != COMMA) tape_syntax_error(token);
+                    token = yylex();
+                }
+            }
+            tape->entries[index].next = tape->num_entries;
+            depth--;
+            break;
+
+        case LBRACKET:
+            index = push_entry(tape, ARRAY_NODE);
+            depth++;
+            token = yylex();
+            if (token != RBRACKET) {
+                for (;;) {
+                    parse_value(tape, token);
+
+                    token = yylex();
+                    if (token == RBRACKET) break;
+                    if (token != COMMA) tape_syntax_error(token);
+                    token = yylex();
+                }
+            }
+            tape->entries[index].next = tape->num_entries;
+            depth--;
+            break;
+
+        case STRING:
+            index = push_entry(tape, STRING_NODE);
+            tape->entries[index].string_offset = push_string(tape, yylval.str_val);
+            free(yylval.str_val);
+            break;
+
+        case NUMBER:
+            index = push_entry(tape, NUMBER_NODE);
+            tape->entries[index].number_value = yylval.num_val;
+            break;
+
+        case TRUE:
+        case FALSE:
+            index = push_entry(tape, BOOLEAN_NODE);
+            tape->entries[index].boolean_value = token == TRUE;
+            break;
+
+        case NULLVAL:
+            push_entry(tape, NULL_NODE);
+            break;
+
+        default:
+            tape_syntax_error(token);
+    }
+}
+
+Tape *parse_json_to_tape(FILE *input) {
+    Tape *tape = calloc(1, sizeof(Tape));
+    if (!tape) {
+        perror("Failed to allocate tape");
+        exit(1);
+    }
+
+    if (setjmp(tape_error)) {
+        free_tape(tape);
+        return NULL;
+    }
+
+    yyin = input;
+    depth = 0;
+    parse_value(tape, yylex());
+    int token = yylex();
+    if (token != 0) tape_syntax_error(token);
+
+    return tape;
+}
+
+const char *tape_string(const Tape *tape, unsigned int index) {
+    return tape->strings + tape->entries[index].string_offset;
+}
+
+size_t tape_memory_usage(const Tape *tape) {
+    return sizeof(Tape) + tape->capacity * sizeof(TapeEntry) + tape->strings_capacity;
+}
+
+void free_tape(Tape *tape) {
+    if (!tape) return;
+    free(tape->entries);
+    free(tape->strings);
+    free(tape);
+}
@@ -0,0 +1,60 @@
+#ifndef TAPE_H
+#define TAPE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "ast.h"
+
+/**
+ * One entry of the tape. Entries are stored contiguously in document order:
+ * an object is followed by its pairs, a pair by its value and an array by
+ * its elements. `next` jumps over a whole subtree, so the children of the
+ * container at index i are i + 1, entries[i + 1].next, ... up to entries[i].next.
+ */
+typedef struct {
+    unsigned int type;  // NodeType
+    unsigned int next;  // Index of the first entry after this entry's subtree
+    union {
+        double number_value;
+        int boolean_value;
+        size_t string_offset;  // STRING_NODE: offset of the value in Tape.strings
+        const char *key;       // PAIR_NODE: interned key
+    };
+} TapeEntry;
+
+/**
+ * Flat representation of a parsed JSON document, an alternative to the ASTNode
+ * tree. String values live in one shared buffer; keys are interned.
+ */
+typedef struct {
+    TapeEntry *entries;
+    unsigned int num_entries;
+    unsigned int capacity;
+    char *strings;
+    size_t strings_size;
+    size_t strings_capacity;
+} Tape;
+
+/**
+ * Parses JSON from the given input directly into a tape, using the Flex scanner.
+ * Syntax errors are reported through yyerror() like the Bison parser does.
+ *
+ * @param input The file to read.
+ * @return The tape; the root value is entry 0. NULL if the document was
+ *         rejected with parse_errors_recoverable set; the partial tape is freed.
+ */
+Tape *parse_json_to_tape(FILE *input);
+
+/**
+ * Returns the value of a STRING_NODE entry.
+ */
+const char *tape_string(const Tape *tape, unsigned int index);
+
+/**
+ * Returns the number of bytes allocated for the tape.
+ */
+size_t tape_memory_usage(const Tape *tape);
+
+void free_tape(Tape *tape);
+
+#endif